@@ -0,0 +1,36 @@
+// Counts the allocations of the process it's preloaded into and writes the
+// count to the file descriptor in BENCH_ALLOC_FD when it exits, see bench.c.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocations;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor))
+static void report(void) {
+    const char *fd = getenv("BENCH_ALLOC_FD");
+    if (fd == NULL) return;
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%zu\n", allocations);
+    write(atoi(fd), buf, n);
+}
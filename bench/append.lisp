@@ -0,0 +1,8 @@
+; ops: 2000
+; building an array with append, one element per op
+(eval
+    (let a (@))
+    (for (let i 0) (< i 2000) (= i (+ i 1))
+        (= a (append a i)))
+    (println (length a))
+)
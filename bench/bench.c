@@ -0,0 +1,251 @@
+// Runs the workloads in bench/ a few times each and prints one JSON object
+// per workload, so runs from different versions can be diffed.
+//
+// Each workload starts with a `; ops: N` comment saying how many operations
+// it does.  The reported numbers are medians over all runs; allocations are
+// counted by bench/alloc.so, which is preloaded into the interpreter.  With
+// --perf, the interpreter's hardware counters (see `lisp --perf`) are added,
+// null where the machine doesn't have them.
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 100
+#define MAX_FLAGS 16
+
+static const char *perf_names[] = { "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses" };
+#define PERF_COUNT (sizeof(perf_names) / sizeof(*perf_names))
+
+typedef struct {
+    long ns;
+    long allocations;
+    long max_rss_kb;
+    long perf[PERF_COUNT]; // -1 if not counted
+} Sample;
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long median(long *xs, size_t n) {
+    qsort(xs, n, sizeof(*xs), compare_long);
+    return xs[n / 2];
+}
+
+// reads everything written to the pipe until the child closes it
+static void read_pipe(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+    while (len < size - 1 && (n = read(fd, buf + len, size - 1 - len)) > 0) len += n;
+    buf[len] = 0;
+    close(fd);
+}
+
+// the counter from the JSON line `lisp --perf` writes, -1 if it's null or
+// missing
+static long perf_value(const char *json, const char *name) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    const char *at = strstr(json, key);
+    if (at == NULL || strncmp(at + strlen(key), "null", 4) == 0) return -1;
+    return atol(at + strlen(key));
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// reads the `; ops: N` header, returns 0 if there is none
+static long read_ops(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "bench: cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    long ops = 0;
+    if (fscanf(f, "; ops: %ld", &ops) != 1) ops = 0;
+    fclose(f);
+    return ops;
+}
+
+// the workload name is the file name without directory or extension
+static void workload_name(const char *path, char *out, size_t size) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(out, size, "%s", base);
+    char *dot = strrchr(out, '.');
+    if (dot) *dot = 0;
+}
+
+static int run_once(const char *lisp, char **flags, size_t flag_count, const char *alloc_lib, int perf, const char *path, Sample *out) {
+    int fds[2], perf_fds[2] = { -1, -1 };
+    if (pipe(fds) != 0 || (perf && pipe(perf_fds) != 0)) {
+        perror("bench: pipe");
+        exit(1);
+    }
+
+    char perf_path[32];
+    snprintf(perf_path, sizeof(perf_path), "/dev/fd/%d", perf_fds[1]);
+    char *argv[MAX_FLAGS + 5];
+    size_t argc = 0;
+    argv[argc++] = (char *)lisp;
+    if (perf) {
+        argv[argc++] = "--perf";
+        argv[argc++] = perf_path;
+    }
+    for (size_t i = 0; i < flag_count; ++i) argv[argc++] = flags[i];
+    argv[argc++] = (char *)path;
+    argv[argc] = NULL;
+
+    long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("bench: fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (perf) close(perf_fds[0]);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        char fd[16];
+        snprintf(fd, sizeof(fd), "%d", fds[1]);
+        setenv("BENCH_ALLOC_FD", fd, 1);
+        // parsing is part of what's measured; an environment variable rather
+        // than --no-cache, so versions from before the cache can be run too
+        setenv("LISP_NO_CACHE", "1", 1);
+        if (alloc_lib) setenv("LD_PRELOAD", alloc_lib, 1);
+        execv(lisp, argv);
+        fprintf(stderr, "bench: cannot run %s: %s\n", lisp, strerror(errno));
+        _exit(127);
+    }
+    close(fds[1]);
+    if (perf) close(perf_fds[1]);
+
+    char buf[32], perf_buf[512] = {0};
+    read_pipe(fds[0], buf, sizeof(buf));
+    if (perf) read_pipe(perf_fds[0], perf_buf, sizeof(perf_buf));
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("bench: wait4");
+        exit(1);
+    }
+    out->ns = now_ns() - start;
+    out->allocations = *buf ? atol(buf) : -1;
+    out->max_rss_kb = usage.ru_maxrss;
+    for (size_t i = 0; i < PERF_COUNT; ++i) out->perf[i] = perf_value(perf_buf, perf_names[i]);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s failed (status %d)\n", path, status);
+        return 0;
+    }
+    return 1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--runs N] [--lisp PATH] [--alloc PATH] [--perf] [--flag FLAG]... [workload.lisp]...\n", program);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    const char *lisp = "./lisp";
+    const char *alloc_lib = "bench/alloc.so";
+    int perf = 0;
+    char *flags[MAX_FLAGS];
+    size_t flag_count = 0;
+    char **paths = NULL;
+    size_t path_count = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1 || runs > MAX_RUNS) usage(argv[0]);
+        } else if (strcmp(argv[i], "--lisp") == 0 && i + 1 < argc) {
+            lisp = argv[++i];
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+            alloc_lib = *argv[++i] ? argv[i] : NULL;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else if (strcmp(argv[i], "--flag") == 0 && i + 1 < argc) {
+            if (flag_count == MAX_FLAGS) usage(argv[0]);
+            flags[flag_count++] = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            paths = realloc(paths, (path_count + 1) * sizeof(*paths));
+            assert(paths != NULL && "Buy more RAM lol");
+            paths[path_count++] = argv[i];
+        }
+    }
+
+    glob_t found = {0};
+    if (path_count == 0) {
+        if (glob("bench/*.lisp", 0, NULL, &found) != 0) {
+            fprintf(stderr, "bench: no workloads in bench/\n");
+            return 1;
+        }
+        paths = found.gl_pathv;
+        path_count = found.gl_pathc;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < path_count; ++i) {
+        long ops = read_ops(paths[i]);
+        if (ops <= 0) {
+            fprintf(stderr, "bench: %s has no `; ops: N` header\n", paths[i]);
+            failed = 1;
+            continue;
+        }
+
+        long ns[MAX_RUNS], allocations[MAX_RUNS], rss[MAX_RUNS], counters[PERF_COUNT][MAX_RUNS];
+        int ok = 1;
+        for (int r = 0; r < runs && ok; ++r) {
+            Sample s;
+            ok = run_once(lisp, flags, flag_count, alloc_lib, perf, paths[i], &s);
+            ns[r] = s.ns;
+            allocations[r] = s.allocations;
+            rss[r] = s.max_rss_kb;
+            for (size_t c = 0; c < PERF_COUNT; ++c) counters[c][r] = s.perf[c];
+        }
+        if (!ok) {
+            failed = 1;
+            continue;
+        }
+
+        char name[256];
+        workload_name(paths[i], name, sizeof(name));
+        long median_ns = median(ns, runs);
+        printf("{\"name\": \"%s\", \"ops\": %ld, \"runs\": %d, \"median_ns_per_op\": %.1f, \"median_ms\": %.3f, \"allocations\": %ld, \"max_rss_kb\": %ld",
+               name, ops, runs, (double)median_ns / ops, median_ns / 1e6, median(allocations, runs), median(rss, runs));
+        if (perf) {
+            long medians[PERF_COUNT];
+            for (size_t c = 0; c < PERF_COUNT; ++c) {
+                medians[c] = median(counters[c], runs);
+                // a counter that's missing in any run is no use
+                if (counters[c][0] < 0) medians[c] = -1;
+                if (medians[c] < 0) printf(", \"%s\": null", perf_names[c]);
+                else printf(", \"%s\": %ld", perf_names[c], medians[c]);
+            }
+            if (medians[0] > 0 && medians[1] >= 0) printf(", \"ipc\": %.3f", (double)medians[1] / medians[0]);
+            else printf(", \"ipc\": null");
+        }
+        printf("}\n");
+        fflush(stdout);
+    }
+
+    return failed;
+}
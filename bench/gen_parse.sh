@@ -0,0 +1,14 @@
+#!/bin/sh
+# Writes the large-source parsing workload: lots of small function
+# definitions, each in a scope of its own so running them stays cheap.
+n=${1:-20000}
+echo "; ops: $n"
+echo "; parsing a large source, one function definition per op"
+echo "(eval"
+awk -v n="$n" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "    (eval (let f%d (function a b (if (< a b) (+ a (* b %d)) (- a \"s%d\")))) (f%d 1 2))\n", i, i, i, i
+    }
+}'
+echo "    (println \"done\")"
+echo ")"
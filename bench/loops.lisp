@@ -0,0 +1,13 @@
+; ops: 1000000
+; nested for and while loops, one inner iteration per op
+(eval
+    (let sum 0)
+    (for (let i 0) (< i 1000) (= i (+ i 1))
+        (eval
+            (let j 0)
+            (while (< j 1000)
+                (eval
+                    (= sum (+ sum (- i j)))
+                    (= j (+ j 1))))))
+    (println sum)
+)
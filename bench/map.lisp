@@ -0,0 +1,13 @@
+; ops: 200000
+; map with a user function over a 1000 element array, one element per op
+(eval
+    (let a (@))
+    (for (let i 0) (< i 1000) (= i (+ i 1))
+        (= a (append a i)))
+    (let total 0)
+    (for (let r 0) (< r 200) (= r (+ r 1))
+        (eval
+            (let b (map a (function x (* x 2))))
+            (= total (+ total (. b 999)))))
+    (println total)
+)
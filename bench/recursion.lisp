@@ -0,0 +1,6 @@
+; ops: 242785
+; naive fib: every op is one call to a user function
+(eval
+    (let fib (function n (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+    (println (fib 25))
+)
@@ -0,0 +1,17 @@
+; ops: 100000
+; nested scopes with many variables, each op declares a few and reads some
+; from further out
+(eval
+    (let a 1) (let b 2) (let c 3) (let d 4) (let e 5)
+    (let f 6) (let g 7) (let h 8) (let k 9) (let l 10)
+    (let total 0)
+    (for (let i 0) (< i 100000) (= i (+ i 1))
+        (eval
+            (let x (+ a b))
+            (eval
+                (let y (+ c d x))
+                (eval
+                    (let z (+ e f g h k l y))
+                    (= total (+ total z))))))
+    (println total)
+)
@@ -0,0 +1,8 @@
+; ops: 20000
+; growing a string with +, one character per op
+(eval
+    (let s "")
+    (for (let i 0) (< i 20000) (= i (+ i 1))
+        (= s (+ s "x")))
+    (println (length s))
+)
@@ -1,9 +1,42 @@
+#define _GNU_SOURCE // memmem
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define DEBUG
 
@@ -13,31 +46,46 @@
     fprintf(stderr, "\n");                                \
 } while (0);
 
+// Errors unwind to the innermost handler (see `try`), and only print and
+// exit when there is none.
+typedef struct ErrorHandler ErrorHandler;
+ErrorHandler *error_handler = NULL;
+_Noreturn void raise_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
 #ifdef DEBUG
-#define ERROR(...) do {                                                                        \
-    fprintf(stderr, "[ERROR] (%s:%d) %s:%ld:%ld: ", __FILE__, __LINE__, file_name, col, line); \
-    fprintf(stderr, __VA_ARGS__);                                                              \
-    fprintf(stderr, "\n");                                                                     \
-    exit(1);                                                                                   \
+#define ERROR(...) do {                                                                                             \
+    if (!error_handler) fprintf(stderr, "[ERROR] (%s:%d) %s:%ld:%ld: ", __FILE__, __LINE__, file_name, col, line); \
+    raise_error(__VA_ARGS__);                                                                                       \
 } while (0);
 #else // DEBUG
-#define ERROR(...) do {                                            \
-    fprintf(stderr, "[ERROR] %s:%ld:%ld: ", file_name, col, line); \
-    fprintf(stderr, __VA_ARGS__);                                  \
-    fprintf(stderr, "\n");                                         \
-    exit(1);                                                       \
+#define ERROR(...) do {                                                                 \
+    if (!error_handler) fprintf(stderr, "[ERROR] %s:%ld:%ld: ", file_name, col, line); \
+    raise_error(__VA_ARGS__);                                                           \
 } while (0);
 #endif // DEBUG
 
-#define PANIC(...) do {                                     \
-    fprintf(stderr, "[PANIC] %s:%d: ", __FILE__, __LINE__); \
-    fprintf(stderr, __VA_ARGS__);                           \
-    fprintf(stderr, "\n");                                  \
-    exit(1);                                                \
+#define PANIC(...) do {                                                         \
+    if (!error_handler) fprintf(stderr, "[PANIC] %s:%d: ", __FILE__, __LINE__); \
+    raise_error(__VA_ARGS__);                                                   \
 } while (0);
 
+// Everything is allocated through these, so --heap-profile can tell what
+// for; they only add a branch while it's off.
+void *heap_malloc(size_t size);
+void *heap_calloc(size_t count, size_t size);
+void *heap_realloc(void *ptr, size_t size);
+void heap_free(void *ptr);
+
+#define malloc(size) heap_malloc(size)
+#define calloc(count, size) heap_calloc(count, size)
+#define realloc(ptr, size) heap_realloc(ptr, size)
+#define free(ptr) heap_free(ptr)
+
+size_t da_reallocs = 0; // see --stats
+
 #define da_append(da, item)  do {                                                \
     if ((da)->count >= (da)->capacity) {                                         \
+        da_reallocs++;                                                           \
         (da)->capacity = (da)->capacity == 0 ? 16 : (da)->capacity*2;            \
         (da)->items = realloc((da)->items, (da)->capacity*sizeof(*(da)->items)); \
         assert((da)->items != NULL && "Buy more RAM lol");                       \
@@ -92,6 +140,19 @@ typedef struct {
     ssize_t capacity;
 } String;
 
+// Strings with a capacity of -1 borrow their characters (from the source,
+// a literal, stdin, ...) and are never written to.  Owned strings live in a
+// StringBuf, which records how much of the buffer is in use.  Values share
+// buffers freely, so a string is only extended in place when it ends exactly
+// where the buffer's used region ends; otherwise it is copied into a new
+// buffer and the old one is left to whoever else still refers to it.
+typedef struct {
+    size_t used;
+    char data[];
+} StringBuf;
+
+#define STRING_BUF(items) ((StringBuf *)((items) - offsetof(StringBuf, data)))
+
 String new_string(char *cstr) {
     return (String) {
         .items = cstr,
@@ -100,22 +161,35 @@ String new_string(char *cstr) {
     };
 }
 
-void resize_string(String *curr, size_t new_size) {
-    if (curr->count > new_size) return;
-    if (curr->capacity == -1) {
-        char *data = malloc(curr->capacity = new_size);
-        strcpy(data, curr->items);
-        curr->items = data;
-    } else if (curr->capacity < new_size) {
-        curr->items = realloc(curr->items, curr->capacity = new_size);
+// make room for at least `extra` more characters (plus the terminator) at the
+// end of `curr`, moving it into a fresh buffer if it can't grow in place.
+void reserve_string(String *curr, size_t extra) {
+    size_t needed = curr->count + extra + 1;
+    if (curr->items != NULL && curr->capacity > 0
+        && STRING_BUF(curr->items)->used == curr->count
+        && needed <= (size_t)curr->capacity) {
+        return;
     }
+    size_t cap = needed < 16 ? 32 : needed*2;
+    StringBuf *buf = malloc(sizeof(StringBuf) + cap);
+    assert(buf != NULL && "Buy more RAM lol");
+    if (curr->count) memcpy(buf->data, curr->items, curr->count);
+    buf->data[curr->count] = '\0';
+    buf->used = curr->count;
+    curr->items = buf->data;
+    curr->capacity = cap;
 }
 
-void extend_string(String *curr, String other) {
-    resize_string(curr, curr->count + other.count + 1);
-    strncpy(curr->items + curr->count, other.items, other.count);
-    curr->count += other.count;
+void append_string(String *curr, const char *data, size_t n) {
+    reserve_string(curr, n);
+    memcpy(curr->items + curr->count, data, n);
+    curr->count += n;
     curr->items[curr->count] = '\0';
+    STRING_BUF(curr->items)->used = curr->count;
+}
+
+void extend_string(String *curr, String other) {
+    append_string(curr, other.items, other.count);
 }
 
 typedef union {
@@ -141,6 +215,7 @@ int fpeek(FILE *file)
 size_t col = 1;
 size_t line = 1;
 const char *file_name;
+size_t token_line, token_col; // where the last token taken starts
 
 int ftake(FILE *file)
 {
@@ -153,6 +228,13 @@ int ftake(FILE *file)
     return c;
 }
 
+// puts back what ftake took, which is never a newline
+void funtake(FILE *file, int c)
+{
+    ungetc(c, file);
+    col -= 1;
+}
+
 int hex(char c) {
     if ('0' <= c && c <= '9') return c - '0';
     c = c & ~0b0100000; // force upper case
@@ -189,7 +271,7 @@ int take_int(FILE *file, char leading)
             }
             return number;
         } else {
-            ungetc(kind, file);
+            funtake(file, kind);
         }
     }
     number = leading - '0';
@@ -204,6 +286,56 @@ int take_int(FILE *file, char leading)
     return number;
 }
 
+// Identifiers are interned, so variables can be looked up by comparing
+// pointers.  Each one carries a version that changes whenever a variable with
+// that name is declared, assigned or goes out of scope, which is what the call
+// site caches check against.
+typedef struct Symbol {
+    struct Symbol *next;
+    size_t version;
+    int type; // see infer_types
+    bool assigned; // anywhere in the program, see infer_types
+    bool declared; // by the program, as a variable or parameter
+    bool calls_back; // a native that calls the functions it's given
+    size_t defs; // declarations and parameters with this name
+    struct {
+        size_t *items;
+        size_t count;
+        size_t capacity;
+    } readers; // units of infer_types that used the type since it last changed
+    char name[];
+} Symbol;
+
+#define SYMBOL(ident) ((Symbol *) ((ident) - offsetof(Symbol, name)))
+#define SYMBOL_BUCKETS 1024
+
+static Symbol *symbols[SYMBOL_BUCKETS];
+
+const char *intern(const char *name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char *c = name; *c; ++c) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+
+    Symbol **bucket = &symbols[hash % SYMBOL_BUCKETS];
+    for (Symbol *sym = *bucket; sym != NULL; sym = sym->next) {
+        if (!strcmp(sym->name, name)) return sym->name;
+    }
+
+    size_t len = strlen(name);
+    Symbol *sym = malloc(sizeof(Symbol) + len + 1);
+    assert(sym != NULL && "Buy more RAM lol");
+    sym->next = *bucket;
+    sym->version = 1; // call caches start out at 0
+    sym->readers.items = NULL;
+    sym->readers.count = sym->readers.capacity = 0;
+    sym->declared = false;
+    sym->calls_back = false;
+    memcpy(sym->name, name, len + 1);
+    *bucket = sym;
+    return sym->name;
+}
+
 #define MAX_IDENT_LEN 255
 const char *take_ident(FILE *file) {
     char buf[MAX_IDENT_LEN + 1] = {0};
@@ -214,7 +346,7 @@ const char *take_ident(FILE *file) {
         buf[n++] = nc;
         ftake(file);
     }
-    return strdup(buf);
+    return intern(buf);
 }
 
 TokenKind keyword_from_ident(const char *ident) {
@@ -257,12 +389,15 @@ String take_string(FILE *file, char quote) {
     return (String) {
         .items = string,
         .count = len,
+        .capacity = -1,
     };
 }
 
 Token next_token(FILE *file)
 {
     for (;;) {
+        token_line = line;
+        token_col = col;
         int c = ftake(file);
         if (c == EOF) {
             return (Token) {
@@ -380,7 +515,7 @@ Token next_token(FILE *file)
         }
 
         if (isalpha(c) || c == '_') {
-            ungetc(c, file);
+            funtake(file, c);
             const char *ident = take_ident(file);
             return (Token) {
                 .kind = keyword_from_ident(ident),
@@ -411,6 +546,14 @@ const char *tk_names[] = {
     [TK_AT] = "AT",
     [TK_DOT] = "DOT",
 
+    [TK_DEQ] = "DEQ",
+    [TK_BANG] = "BANG",
+    [TK_NEQ] = "NEQ",
+    [TK_LT] = "LT",
+    [TK_LEQ] = "LEQ",
+    [TK_GT] = "GT",
+    [TK_GEQ] = "GEQ",
+
     [TK_LET] = "LET",
     [TK_IF] = "IF",
     [TK_TRUE] = "TRUE",
@@ -539,11 +682,18 @@ typedef enum {
     EK_ASSIGN_VAR,
     EK_WHILE,
     EK_FOR,
+
+    // specialized by type inference, same shape as FUNCTION_CALL
+    EK_INT_ARITH, // + - * / on ints
+    EK_INT_COMPARE, // comparisons of ints
+    EK_STRING_CONCAT, // + starting with a string
+    EK_ARRAY_INDEX, // . on an array with an int
     __EK_LENGTH,
 } ExpressionKind;
 
 static const char *ek_names[] = {
     [EK_ATOM] = "ATOM",
+    [EK_UNIT] = "UNIT",
     [EK_FUNCTION_CALL] = "FUNCTION_CALL",
     [EK_FUNCTION_DEF] = "FUNCTION_DEF",
     [EK_IF] = "IF",
@@ -551,6 +701,10 @@ static const char *ek_names[] = {
     [EK_ASSIGN_VAR] = "ASSIGN_VAR",
     [EK_WHILE] = "WHILE",
     [EK_FOR] = "FOR",
+    [EK_INT_ARITH] = "INT_ARITH",
+    [EK_INT_COMPARE] = "INT_COMPARE",
+    [EK_STRING_CONCAT] = "STRING_CONCAT",
+    [EK_ARRAY_INDEX] = "ARRAY_INDEX",
 };
 
 static_assert(sizeof(ek_names) / sizeof(*ek_names) == __EK_LENGTH, "Missing names for tokens");
@@ -561,9 +715,12 @@ typedef struct {
     size_t capacity;
 } ASTList;
 
+typedef struct CallCache CallCache;
+
 typedef struct {
     Token op;
     ASTList args;
+    CallCache *cache; // only for calls by name
 } FunctionCallValue;
 
 typedef struct {
@@ -572,9 +729,27 @@ typedef struct {
     size_t capacity;
 } ParamList;
 
+// Per function/loop state for the JIT, shared by every copy of the AST node.
+typedef struct JitCode JitCode;
+typedef struct {
+    JitCode *code;
+    bool failed; // can't be compiled, don't try again
+    size_t hotness; // calls or loop iterations run by the interpreter
+} JitSlot;
+
+JitSlot *new_jit_slot(void) {
+    JitSlot *slot = calloc(1, sizeof(JitSlot));
+    assert(slot != NULL && "Buy more RAM lol");
+    return slot;
+}
+
+struct EvalContext;
+
 typedef struct {
     ParamList params;
     AST *body;
+    JitSlot *jit;
+    struct Value (*compiled)(struct EvalContext *ctx); // body, see emit_c
 } FunctionDefValue;
 
 typedef struct {
@@ -583,9 +758,20 @@ typedef struct {
     AST *false_branch; // optional
 } IfValue;
 
+// (for (let i a) (< i b) (= i (+ i c)) body) where nothing else can change i
+// and b doesn't change, see optimize_loops.
+typedef struct {
+    const char *var;
+    AST *bound;
+    TokenKind cmp; // < <= > >=
+    int step;
+} CountedLoop;
+
 typedef struct {
     AST *cond;
     AST *body;
+    ASTList hoisted; // declarations run before the loop, see optimize_loops
+    JitSlot *jit;
 } WhileValue;
 
 typedef struct {
@@ -593,6 +779,9 @@ typedef struct {
     AST *cond;
     AST *post;
     AST *body;
+    ASTList hoisted; // run after init
+    CountedLoop *counted; // optional
+    JitSlot *jit;
 } ForValue;
 
 typedef struct {
@@ -612,11 +801,13 @@ typedef struct {
 
 typedef struct AST {
     ExpressionKind kind;
+    uint32_t line, col; // where the node starts in the source, 0 if made up
     ASTValue value;
 } AST;
 
 static Token peeked;
 static bool have_peeked;
+static uint32_t peeked_line, peeked_col;
 Token take_token(FILE *file) {
     if (have_peeked) {
         have_peeked = false;
@@ -628,6 +819,8 @@ Token take_token(FILE *file) {
 Token *peek_token(FILE *file) {
     if (have_peeked) return &peeked;
     peeked = next_token(file);
+    peeked_line = token_line;
+    peeked_col = token_col;
     have_peeked = true;
     return &peeked; 
 }
@@ -685,6 +878,7 @@ bool is_function_token(TokenKind kind) {
 }
 
 AST parse(FILE *file, const char *expected);
+CallCache *new_call_cache(void);
 
 AST parse_cond(FILE *file) {
     AST cond = parse(file, "condition");
@@ -742,7 +936,8 @@ AST parse_function_def(FILE *file) {
         .value = {
             .fn_def = {
                 .params = params,
-                .body = bodyp
+                .body = bodyp,
+                .jit = new_jit_slot(),
             }
         }
     };
@@ -754,7 +949,7 @@ AST parse_declare(FILE *file) {
         ERROR("Expected name for varaible declaration, got %s", token_string(*peek_token(file)));
     }
 
-    AST *valuep;
+    AST *valuep = NULL;
     if (!take_token_if(file, TK_RPAREN, NULL)) {
         AST value = parse(file, "variable value");
         valuep = malloc(sizeof(AST));
@@ -812,6 +1007,7 @@ AST parse_while(FILE *file) {
             .while_ = {
                 .cond = condp,
                 .body = bodyp,
+                .jit = new_jit_slot(),
             }
         }
     };
@@ -844,6 +1040,7 @@ AST parse_for(FILE *file) {
                 .cond = condp,
                 .post = postp,
                 .body = bodyp,
+                .jit = new_jit_slot(),
             }
         }
     };
@@ -885,12 +1082,16 @@ AST parse_cons(FILE *file) {
         da_append(&args, expr);
     }
 
+    CallCache *cache = NULL;
+    if (tok.kind == TK_IDENT) cache = new_call_cache();
+
     return (AST) {
         .kind = EK_FUNCTION_CALL,
         .value = {
             .fn_call = {
                 .op = tok,
                 .args = args,
+                .cache = cache,
             }
         },
     };
@@ -938,17 +1139,36 @@ AST parse(FILE *file, const char *expected) {
     if (!is_expression_start(tok->kind)) {
         ERROR("expected %s, got %s", expected ? expected : "expression", tk_names[tok->kind]);
     }
+    uint32_t at_line = peeked_line, at_col = peeked_col;
+    AST ast;
     switch (tok->kind) {
         case TK_LPAREN:
-            return parse_cons(file);
+            ast = parse_cons(file);
+            break;
         default: // TODO: this should enumerate each case
-            return (AST) {
+            ast = (AST) {
                 .kind = EK_ATOM,
                 .value = {
                     .atom = take_token(file),
                 }
             };
     }
+    ast.line = at_line;
+    ast.col = at_col;
+    return ast;
+}
+
+void print_ast(AST *ast, size_t depth);
+
+void print_hoisted(ASTList hoisted, size_t depth) {
+    if (hoisted.count == 0) return;
+    printf("%*s", (int) depth * 4 + 4, "");
+    printf("hoisted: [\n");
+    for (size_t i = 0; i < hoisted.count; ++i) {
+        print_ast(&hoisted.items[i], depth + 2);
+    }
+    printf("%*s", (int) depth * 4 + 4, "");
+    printf("]\n");
 }
 
 void print_ast(AST *ast, size_t depth) {
@@ -995,7 +1215,11 @@ void print_ast(AST *ast, size_t depth) {
             printf("%*s}\n", prefix, "");
         } break;
         case EK_FUNCTION_CALL:
-            printf("FunctionCall {\n");
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            printf("%s {\n", ast->kind == EK_FUNCTION_CALL ? "FunctionCall" : ek_names[ast->kind]);
             printf("%*s", prefix + 4, "");
             printf("op: %s\n", token_string(ast->value.fn_call.op));
             printf("%*s", prefix + 4, "");
@@ -1032,6 +1256,7 @@ void print_ast(AST *ast, size_t depth) {
         case EK_WHILE: {
             WhileValue w = ast->value.while_;
             printf("while {\n");
+            print_hoisted(w.hoisted, depth);
 
             printf("%*s", prefix + 4, "");
             printf("condition:\n");
@@ -1049,6 +1274,11 @@ void print_ast(AST *ast, size_t depth) {
             printf("%*s", prefix + 4, "");
             printf("init:\n");
                 print_ast(f.init, depth + 2);
+            print_hoisted(f.hoisted, depth);
+            if (f.counted) {
+                printf("%*s", prefix + 4, "");
+                printf("counted: %s by %d\n", f.counted->var, f.counted->step);
+            }
 
             printf("%*s", prefix + 4, "");
             printf("condition:\n");
@@ -1076,6 +1306,8 @@ typedef enum {
     VK_FUNCTION,
     VK_NATIVE_FUNCTION,
     VK_ARRAY,
+    VK_READER,
+    VK_MAP,
     __VK_LENGTH,
 } ValueKind;
 
@@ -1088,18 +1320,93 @@ const char *vk_names[] = {
     [VK_FUNCTION] = "FUNCTION",
     [VK_NATIVE_FUNCTION] = "NATIVE_FUNCTION",
     [VK_ARRAY] = "ARRAY",
+    [VK_READER] = "READER",
+    [VK_MAP] = "MAP",
 };
 
 static_assert(sizeof(vk_names) / sizeof(*vk_names) == __VK_LENGTH, "");
 
+// Counters of the evaluator's work, always kept (they're only increments)
+// and printed at exit with --stats.
+typedef struct {
+    size_t evals[__EK_LENGTH];
+    size_t contexts; // create_ctx calls
+    size_t lookups; // get_var calls
+    size_t lookup_depth; // contexts looked through by them
+    size_t coercions[__VK_LENGTH][__VK_LENGTH]; // from, to
+    size_t errors; // caught by try
+} Stats;
+
+Stats stats = { 0 };
+
+// Calls to natives by name.  Their names are string literals, so the
+// pointer is enough to tell them apart.
+#define NATIVE_CALLS_SLOTS 256
+
+typedef struct {
+    const char *name;
+    size_t calls;
+} NativeCalls;
+
+static NativeCalls native_calls[NATIVE_CALLS_SLOTS];
+
+static inline void count_native_call(const char *name) {
+    size_t i = ((uintptr_t) name >> 3) % NATIVE_CALLS_SLOTS;
+    for (size_t n = 0; n < NATIVE_CALLS_SLOTS; ++n, i = (i + 1) % NATIVE_CALLS_SLOTS) {
+        if (native_calls[i].name == name || native_calls[i].name == NULL) {
+            native_calls[i].name = name;
+            native_calls[i].calls++;
+            return;
+        }
+    }
+}
+
+int by_calls(const void *a, const void *b) {
+    const NativeCalls *x = a, *y = b;
+    if (x->calls != y->calls) return x->calls < y->calls ? 1 : -1;
+    if (x->name == NULL || y->name == NULL) return (x->name == NULL) - (y->name == NULL);
+    return strcmp(x->name, y->name);
+}
+
+void stats_report(void) {
+    fprintf(stderr, "[STATS] evaluations by kind:\n");
+    for (size_t i = 0; i < __EK_LENGTH; ++i) {
+        if (stats.evals[i]) fprintf(stderr, "  %-16s %12ld\n", ek_names[i], stats.evals[i]);
+    }
+    fprintf(stderr, "[STATS] contexts created: %ld\n", stats.contexts);
+    fprintf(stderr, "[STATS] variable lookups: %ld, %.2f contexts deep on average\n",
+            stats.lookups, stats.lookups ? (double) stats.lookup_depth / stats.lookups : 0.0);
+    fprintf(stderr, "[STATS] coercions:\n");
+    for (size_t from = 0; from < __VK_LENGTH; ++from) {
+        for (size_t to = 0; to < __VK_LENGTH; ++to) {
+            if (!stats.coercions[from][to]) continue;
+            char kinds[64];
+            snprintf(kinds, sizeof(kinds), "%s -> %s", vk_names[from], vk_names[to]);
+            fprintf(stderr, "  %-24s %12ld\n", kinds, stats.coercions[from][to]);
+        }
+    }
+    fprintf(stderr, "[STATS] da_append reallocations: %ld\n", da_reallocs);
+    fprintf(stderr, "[STATS] errors caught: %ld\n", stats.errors);
+    fprintf(stderr, "[STATS] native calls:\n");
+    qsort(native_calls, NATIVE_CALLS_SLOTS, sizeof(*native_calls), by_calls);
+    for (size_t i = 0; i < NATIVE_CALLS_SLOTS && native_calls[i].calls; ++i) {
+        fprintf(stderr, "  %-16s %12ld\n", native_calls[i].name, native_calls[i].calls);
+    }
+}
+
 typedef struct Value Value;
 typedef struct EvalContext EvalContext;
+typedef struct Map Map;
 
 typedef struct {
     const char *name;
     ssize_t min_args;
     ssize_t max_args;
     Value (*fn)(EvalContext *ctx, size_t argc, Value *argv);
+    // natives made while running (like memo's) have state, and are called
+    // through this instead
+    Value (*bound)(void *data, EvalContext *ctx, size_t argc, Value *argv);
+    void *data;
 } NativeFunctionValue;
 
 typedef struct {
@@ -1108,6 +1415,21 @@ typedef struct {
     size_t capacity;
 } ValueArray;
 
+// Splits a file into lines, reading it in large blocks.  The lines handed out
+// point into the block (the newline is overwritten with a terminator), which
+// is never moved or reused once they do, so they can be kept like any other
+// string.
+typedef struct {
+    int fd;
+    bool eof;
+    size_t start; // first byte not yet handed out
+    size_t count;
+    size_t capacity;
+    char *items;
+} LineReader;
+
+#define READER_BLOCK_SIZE (1024 * 1024)
+
 typedef union {
     int integer;
     char character;
@@ -1115,6 +1437,8 @@ typedef union {
     FunctionDefValue fn;
     NativeFunctionValue native;
     ValueArray array;
+    LineReader *reader;
+    Map *map;
 } ValueValue;
 
 typedef struct Value {
@@ -1123,32 +1447,238 @@ typedef struct Value {
     bool immutable;
 } Value;
 
+// What a call site's function name resolved to last time.  It's still right
+// as long as no variable with that name has been touched since.
+struct CallCache {
+    size_t version; // of the name's symbol
+    Value fn;
+};
+
+CallCache *new_call_cache(void) {
+    CallCache *cache = calloc(1, sizeof(CallCache));
+    assert(cache != NULL && "Buy more RAM lol");
+    return cache;
+}
+
 void free_value(Value *v) {
-    switch (v->kind) {
-        case VK_UNIT:
+    // Values are copied shallowly: copies of an array share its items and
+    // copies of a string share its buffer, and nothing keeps track of how
+    // many copies are still around.  So a variable going out of scope can't
+    // free what it points to.
+    // TODO: Fix double free when we have a function that has itself in one of the parameters:
+    // (eval
+    //     (function foo a (println a ))
+    //     (foo foo)
+    // )
+    // free((void *)v->value.fn.params.items);
+}
+
+// Hash map from INT, CHAR, STRING and BOOL keys to values, using open
+// addressing in the style of Swiss tables: a separate array of control bytes
+// holds either EMPTY, DELETED or the low 7 bits of a full slot's hash, and a
+// probe compares a whole group of 16 control bytes against the hash at once
+// before looking at any keys.
+#define MAP_GROUP_SIZE 16
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+typedef struct {
+    Value key;
+    Value value;
+} MapEntry;
+
+typedef struct Map {
+    // capacity + MAP_GROUP_SIZE bytes, the last group mirrors the first so
+    // that a group can be loaded starting from any slot.
+    int8_t *ctrl;
+    MapEntry *entries;
+    size_t capacity; // power of two
+    size_t count;
+    size_t deleted;
+} Map;
+
+// bit i is set when byte i of the group equals `tag`
+static inline uint32_t group_match(const int8_t *group, int8_t tag) {
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; ++i) bits |= (uint32_t)(group[i] == tag) << i;
+    return bits;
+#endif
+}
+
+// bit i is set when slot i of the group is EMPTY or DELETED (both negative)
+static inline uint32_t group_match_free(const int8_t *group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; ++i) bits |= (uint32_t)(group[i] < 0) << i;
+    return bits;
+#endif
+}
+
+uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t hash_bytes(const char *data, size_t n) {
+    uint64_t h = n * 0x9e3779b97f4a7c15ULL;
+    for (; n >= 8; data += 8, n -= 8) {
+        uint64_t k;
+        memcpy(&k, data, 8);
+        h = ((h << 5 | h >> 59) ^ k) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t k = 0;
+    memcpy(&k, data, n);
+    return hash_mix(h ^ k);
+}
+
+bool is_hashable(ValueKind kind) {
+    return kind == VK_INT || kind == VK_CHAR || kind == VK_STRING || kind == VK_BOOL;
+}
+
+uint64_t hash_value(Value v) {
+    switch (v.kind) {
         case VK_INT:
+            return hash_mix((uint64_t)(unsigned int)v.value.integer ^ ((uint64_t)VK_INT << 32));
         case VK_CHAR:
+            return hash_mix((uint64_t)(unsigned char)v.value.character ^ ((uint64_t)VK_CHAR << 32));
         case VK_BOOL:
-        case VK_NATIVE_FUNCTION:
-        case __VK_LENGTH:
-            break;
+            return hash_mix((uint64_t)!!v.value.integer ^ ((uint64_t)VK_BOOL << 32));
         case VK_STRING:
-        case VK_ARRAY:
-            for (size_t i = 0; i < v->value.array.count; ++i) {
-                free_value(&v->value.array.items[i]);
-            }
-            free(v->value.array.items);
-        case VK_FUNCTION:
-            // TODO: Fix double free when we have a function that has itself in one of the parameters:
-            // (eval
-            //     (function foo a (println a ))
-            //     (foo foo)
-            // )
-            // free((void *)v->value.fn.params.items);
-            return;
+            return hash_bytes(v.value.string.items, v.value.string.count);
+        default:
+            PANIC("Cannot use %s as a map key", vk_names[v.kind]);
     }
 }
 
+bool keys_equal(Value a, Value b) {
+    if (a.kind != b.kind) return false;
+    switch (a.kind) {
+        case VK_INT:
+            return a.value.integer == b.value.integer;
+        case VK_CHAR:
+            return a.value.character == b.value.character;
+        case VK_BOOL:
+            return !!a.value.integer == !!b.value.integer;
+        case VK_STRING:
+            return a.value.string.count == b.value.string.count
+                && !memcmp(a.value.string.items, b.value.string.items, a.value.string.count);
+        default:
+            return false;
+    }
+}
+
+static inline void map_set_ctrl(Map *m, size_t i, int8_t ctrl) {
+    m->ctrl[i] = ctrl;
+    if (i < MAP_GROUP_SIZE) m->ctrl[m->capacity + i] = ctrl;
+}
+
+// index of the slot holding `key`, or -1
+ssize_t map_find(Map *m, Value key, uint64_t hash) {
+    if (m->capacity == 0) return -1;
+    size_t mask = m->capacity - 1;
+    int8_t tag = hash & 0x7f;
+    size_t pos = (hash >> 7) & mask;
+    for (size_t step = MAP_GROUP_SIZE;; step += MAP_GROUP_SIZE) {
+        const int8_t *group = m->ctrl + pos;
+        for (uint32_t bits = group_match(group, tag); bits; bits &= bits - 1) {
+            size_t i = (pos + __builtin_ctz(bits)) & mask;
+            if (keys_equal(m->entries[i].key, key)) return i;
+        }
+        if (group_match(group, CTRL_EMPTY)) return -1;
+        pos = (pos + step) & mask;
+    }
+}
+
+// first EMPTY or DELETED slot on the probe sequence of `hash`
+size_t map_find_free(Map *m, uint64_t hash) {
+    size_t mask = m->capacity - 1;
+    size_t pos = (hash >> 7) & mask;
+    for (size_t step = MAP_GROUP_SIZE;; step += MAP_GROUP_SIZE) {
+        uint32_t bits = group_match_free(m->ctrl + pos);
+        if (bits) return (pos + __builtin_ctz(bits)) & mask;
+        pos = (pos + step) & mask;
+    }
+}
+
+void map_resize(Map *m, size_t capacity) {
+    Map old = *m;
+    m->capacity = capacity;
+    m->ctrl = malloc(capacity + MAP_GROUP_SIZE);
+    m->entries = malloc(capacity * sizeof(MapEntry));
+    assert(m->ctrl != NULL && m->entries != NULL && "Buy more RAM lol");
+    memset(m->ctrl, CTRL_EMPTY, capacity + MAP_GROUP_SIZE);
+    m->deleted = 0;
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.ctrl[i] < 0) continue;
+        uint64_t hash = hash_value(old.entries[i].key);
+        size_t slot = map_find_free(m, hash);
+        map_set_ctrl(m, slot, hash & 0x7f);
+        m->entries[slot] = old.entries[i];
+    }
+    free(old.ctrl);
+    free(old.entries);
+}
+
+Map *new_map(size_t count) {
+    Map *m = calloc(1, sizeof(Map));
+    assert(m != NULL && "Buy more RAM lol");
+    size_t capacity = MAP_GROUP_SIZE;
+    while (count * 8 > capacity * 7) capacity *= 2;
+    map_resize(m, capacity);
+    return m;
+}
+
+void map_put(Map *m, Value key, Value value) {
+    uint64_t hash = hash_value(key);
+    ssize_t found = map_find(m, key, hash);
+    if (found >= 0) {
+        m->entries[found].value = value;
+        return;
+    }
+    // keep at most 7/8 of the slots in use, tombstones included
+    if ((m->count + m->deleted + 1) * 8 > m->capacity * 7) {
+        map_resize(m, (m->count + 1) * 2 > m->capacity ? m->capacity * 2 : m->capacity);
+    }
+    // borrowed strings may point into buffers that get reused (see `lines`)
+    if (key.kind == VK_STRING && key.value.string.capacity < 0) {
+        String owned = { 0 };
+        extend_string(&owned, key.value.string);
+        key.value.string = owned;
+    }
+    size_t slot = map_find_free(m, hash);
+    if (m->ctrl[slot] == CTRL_DELETED) m->deleted -= 1;
+    map_set_ctrl(m, slot, hash & 0x7f);
+    m->entries[slot] = (MapEntry) {
+        .key = key,
+        .value = value,
+    };
+    m->count += 1;
+}
+
+Value *map_get(Map *m, Value key) {
+    ssize_t found = map_find(m, key, hash_value(key));
+    return found < 0 ? NULL : &m->entries[found].value;
+}
+
+bool map_remove(Map *m, Value key) {
+    ssize_t found = map_find(m, key, hash_value(key));
+    if (found < 0) return false;
+    map_set_ctrl(m, found, CTRL_DELETED);
+    m->count -= 1;
+    m->deleted += 1;
+    return true;
+}
+
 bool value_to_bool(Value v) {
     switch (v.kind) {
     case VK_UNIT:
@@ -1162,61 +1692,195 @@ bool value_to_bool(Value v) {
     case VK_ARRAY:
     case VK_FUNCTION:
     case VK_NATIVE_FUNCTION:
+    case VK_READER:
+    case VK_MAP:
         PANIC("Cannot convert %s to BOOL", vk_names[v.kind]);
     case __VK_LENGTH: PANIC("unreachable");
     }
     PANIC("unreachable");
 }
 
-char *value_to_string(Value value) {
+// Everything the script prints goes through this buffer instead of stdio,
+// so that output-heavy scripts do a few large write(2) calls rather than a
+// (locked) printf per value.  It is flushed when full, at exit, before
+// reading from stdin, and by `flush`.  In line-buffered mode (the default
+// when stdout is a terminal) it is also flushed after every print.
+#define OUT_BUF_CAP (64 * 1024)
+
+typedef struct {
+    int fd;
+    bool line_buffered;
+    size_t count;
+    char items[OUT_BUF_CAP];
+} OutBuf;
+
+OutBuf out = {
+    .fd = STDOUT_FILENO,
+};
+
+bool out_try_write_all(const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(out.fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += w;
+        n -= w;
+    }
+    return true;
+}
+
+void out_write_all(const char *data, size_t n) {
+    if (!out_try_write_all(data, n)) PANIC("Could not write to stdout: %m");
+}
+
+void out_flush(void) {
+    size_t n = out.count;
+    // reset first so that a failing write doesn't get retried by the atexit handler
+    out.count = 0;
+    out_write_all(out.items, n);
+}
+
+// out_flush for atexit, where PANIC's exit() isn't allowed
+void out_flush_at_exit(void) {
+    size_t n = out.count;
+    out.count = 0;
+    if (out_try_write_all(out.items, n)) return;
+    fprintf(stderr, "[PANIC] Could not write to stdout: %m\n");
+    _exit(1);
+}
+
+void out_write(const char *data, size_t n) {
+    if (out.count + n > OUT_BUF_CAP) {
+        out_flush();
+        if (n >= OUT_BUF_CAP) {
+            out_write_all(data, n);
+            return;
+        }
+    }
+    memcpy(out.items + out.count, data, n);
+    out.count += n;
+}
+
+void out_init(bool line_buffered) {
+    out.line_buffered = line_buffered || isatty(out.fd);
+    // anything printed through stdio before now (e.g. the AST dump) must come first
+    fflush(stdout);
+    atexit(out_flush_at_exit);
+}
+
+// Destination for format_value: either a string being built or, when
+// `string` is NULL, the output buffer.
+typedef struct {
+    String *string;
+} Sink;
+
+void sink_write(Sink sink, const char *data, size_t n) {
+    if (sink.string) append_string(sink.string, data, n);
+    else out_write(data, n);
+}
+
+void sink_cstr(Sink sink, const char *cstr) {
+    sink_write(sink, cstr, strlen(cstr));
+}
+
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// enough for "-2147483648"
+#define INT_BUF_LEN 12
+
+// Writes n in decimal so that it ends right before `end` and returns a
+// pointer to its first character.
+char *format_int(char *end, int n) {
+    unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    while (u >= 100) {
+        unsigned int r = u % 100;
+        u /= 100;
+        end -= 2;
+        memcpy(end, &digit_pairs[r*2], 2);
+    }
+    if (u >= 10) {
+        end -= 2;
+        memcpy(end, &digit_pairs[u*2], 2);
+    } else {
+        *--end = '0' + u;
+    }
+    if (n < 0) *--end = '-';
+    return end;
+}
+
+void format_value(Sink sink, Value value) {
     switch (value.kind) {
         case __VK_LENGTH: PANIC("unreachable");
-        case VK_CHAR: {
-            char *str = malloc(2);
-            str[0] = value.value.character;
-            str[1] = '\0';
-            return str;
-        }
+        case VK_CHAR:
+            sink_write(sink, &value.value.character, 1);
+            break;
         case VK_INT: {
-            char buf[20];
-            snprintf(buf, 20, "%d", value.value.integer);
-            return strdup(buf);
-        }
+            char buf[INT_BUF_LEN];
+            char *start = format_int(buf + INT_BUF_LEN, value.value.integer);
+            sink_write(sink, start, buf + INT_BUF_LEN - start);
+        } break;
         case VK_STRING:
-            return value.value.string.items;
+            sink_write(sink, value.value.string.items, value.value.string.count);
+            break;
         case VK_BOOL:
-            return value.value.integer ? "true" : "false";
-        case VK_FUNCTION: {
-            char buf[256];
-            snprintf(buf, 256, "<anonymous function>");
-            return strdup(buf);
-        }
-        case VK_NATIVE_FUNCTION: {
-            char buf[256];
-            snprintf(buf, 256, "<native function '%s'>", value.value.native.name);
-            return strdup(buf);
-        }
-        case VK_ARRAY: {
-            String s = new_string("(@");
+            sink_cstr(sink, value.value.integer ? "true" : "false");
+            break;
+        case VK_FUNCTION:
+            sink_cstr(sink, "<anonymous function>");
+            break;
+        case VK_NATIVE_FUNCTION:
+            sink_cstr(sink, "<native function '");
+            sink_cstr(sink, value.value.native.name);
+            sink_cstr(sink, "'>");
+            break;
+        case VK_ARRAY:
+            sink_write(sink, "(@", 2);
             for (size_t i = 0; i < value.value.array.count; ++i) {
-                extend_string(&s, new_string(" "));
-                extend_string(&s, new_string(value_to_string(value.value.array.items[i])));
+                sink_write(sink, " ", 1);
+                format_value(sink, value.value.array.items[i]);
             }
-            extend_string(&s, new_string(")"));
-            return strdup(s.items);
-        }
+            sink_write(sink, ")", 1);
+            break;
         case VK_UNIT:
-            return "()";
+            sink_write(sink, "()", 2);
+            break;
+        case VK_READER:
+            sink_cstr(sink, "<reader>");
+            break;
+        case VK_MAP: {
+            Map *m = value.value.map;
+            sink_write(sink, "(dict", 5);
+            for (size_t i = 0; i < m->capacity; ++i) {
+                if (m->ctrl[i] < 0) continue;
+                sink_write(sink, " ", 1);
+                format_value(sink, m->entries[i].key);
+                sink_write(sink, " ", 1);
+                format_value(sink, m->entries[i].value);
+            }
+            sink_write(sink, ")", 1);
+        } break;
     }
-    return NULL;
+}
+
+String value_to_string(Value value) {
+    if (value.kind == VK_STRING) return value.value.string;
+    String s = { 0 };
+    format_value((Sink) { .string = &s }, value);
+    if (s.items == NULL) reserve_string(&s, 0);
+    return s;
 }
 
 bool coerce(Value *value, ValueKind vk) {
+    stats.coercions[value->kind][vk]++;
     if (value->kind == vk) return true;
     switch (vk) {
         case VK_STRING:
+            value->value.string = value_to_string(*value);
             value->kind = vk;
-            value->value.string = new_string((char *)value_to_string(*value));
             return true;
         case VK_BOOL:
             value->kind = vk;
@@ -1225,6 +1889,8 @@ bool coerce(Value *value, ValueKind vk) {
         case VK_UNIT: // TODO: make everything coerce into a unit?
             return false;
         case VK_ARRAY:
+        case VK_READER:
+        case VK_MAP:
             return false;
         case VK_CHAR: {
             if (value->kind != VK_INT) return false;
@@ -1246,6 +1912,8 @@ bool coerce(Value *value, ValueKind vk) {
                 case VK_FUNCTION:
                 case VK_NATIVE_FUNCTION:
                 case VK_ARRAY:
+                case VK_READER:
+                case VK_MAP:
                     return false;
                 case __VK_LENGTH: PANIC("unreachable");
             }
@@ -1265,8 +1933,7 @@ void add_value(Value *curr, Value new) {
     }
 
     if (curr->kind == VK_STRING) {
-        String right = new_string(value_to_string(new));
-        extend_string(&curr->value.string, right);
+        format_value((Sink) { .string = &curr->value.string }, new);
         return;
     }
 
@@ -1292,10 +1959,17 @@ void mult_value(Value *curr, Value new) {
     curr->kind = VK_INT;
 }
 
+// both of these would be a SIGFPE
+int div_int(int n, int d) {
+    if (d == 0) PANIC("Division by zero");
+    if (d == -1 && n == INT_MIN) PANIC("Division overflow");
+    return n / d;
+}
+
 void div_value(Value *curr, Value new) {
     if (curr->kind != VK_INT || new.kind != VK_INT) PANIC("Cannot divide %s by %s", vk_names[curr->kind], vk_names[new.kind]);
 
-    curr->value.integer /= new.value.integer;
+    curr->value.integer = div_int(curr->value.integer, new.value.integer);
     curr->kind = VK_INT;
 }
 
@@ -1314,28 +1988,37 @@ typedef struct {
 typedef struct EvalContext {
     VariableMap vars;
     EvalContext *parent;
+    EvalContext *outer; // innermost_ctx before this one
 } EvalContext;
 
+// the scope being evaluated in, which is where errors unwind from
+EvalContext *innermost_ctx = NULL;
+
 EvalContext create_ctx(EvalContext *parent) {
+    stats.contexts++;
     return (EvalContext) {
         .vars = { 0 },
         .parent = parent,
+        .outer = innermost_ctx,
     };
 }
 
 void free_ctx(EvalContext ctx) {
     for (size_t i = 0; i < ctx.vars.count; ++i) {
+        SYMBOL(ctx.vars.items[i].key)->version++;
         free_value(&ctx.vars.items[i].value);
     }
     free(ctx.vars.items);
 }
 
 // adds a var to the ctx with the value of UNIT.
+// names of variables must be interned.
 Value *add_var(EvalContext *ctx, const char *name) {
     for (size_t i = 0; i < ctx->vars.count; ++i) {
         VariableMapEntry entry = ctx->vars.items[i];
-        if (!strcmp(entry.key, name)) PANIC("Variable '%s' already declared.", name);
+        if (entry.key == name) PANIC("Variable '%s' already declared.", name);
     }
+    SYMBOL(name)->version++;
     Value v = { 0 };
     VariableMapEntry entry = {
         .key = name,
@@ -1346,9 +2029,10 @@ Value *add_var(EvalContext *ctx, const char *name) {
 }
 
 void set_var(EvalContext *ctx, const char *name, Value v) {
+    SYMBOL(name)->version++;
     for (size_t i = 0; i < ctx->vars.count; ++i) {
         VariableMapEntry *entry = &ctx->vars.items[i];
-        if (!strcmp(entry->key, name)) {
+        if (entry->key == name) {
             entry->value = v;
             return;
         }
@@ -1361,13 +2045,16 @@ void set_var(EvalContext *ctx, const char *name, Value v) {
 }
 
 Value *get_var(EvalContext *ctx, const char *name) {
-    for (size_t i = 0; i < ctx->vars.count; ++i) {
-        VariableMapEntry entry = ctx->vars.items[i];
-        if (!strcmp(entry.key, name))
-            return &ctx->vars.items[i].value;
+    stats.lookups++;
+    for (; ctx != NULL; ctx = ctx->parent) {
+        stats.lookup_depth++;
+        for (size_t i = 0; i < ctx->vars.count; ++i) {
+            VariableMapEntry entry = ctx->vars.items[i];
+            if (entry.key == name)
+                return &ctx->vars.items[i].value;
+        }
     }
-    if (ctx->parent == NULL) return NULL;
-    return get_var(ctx->parent, name);
+    return NULL;
 }
 
 // (inclusive)
@@ -1417,7 +2104,7 @@ Ordering compare_values(Value a, Value b) {
         case VK_STRING:
             if (a.value.string.count < b.value.string.count) return ORD_LESS; 
             if (a.value.string.count > b.value.string.count) return ORD_GREATER; 
-            int cmp = strncmp(a.value.string.items, b.value.string.items, a.value.string.count);
+            int cmp = memcmp(a.value.string.items, b.value.string.items, a.value.string.count);
             return ord_from_int(cmp);
         case VK_BOOL:
             if (!!a.value.integer == !!b.value.integer) return ORD_EQ;
@@ -1426,564 +2113,5126 @@ Ordering compare_values(Value a, Value b) {
             return ORD_NONE;
         case VK_NATIVE_FUNCTION:
             return ORD_NONE;
+        case VK_READER:
+            return a.value.reader == b.value.reader ? ORD_EQ : ORD_NEQ;
+        case VK_MAP: {
+            Map *am = a.value.map;
+            Map *bm = b.value.map;
+            if (am->count != bm->count) return ORD_NEQ;
+            for (size_t i = 0; i < am->capacity; ++i) {
+                if (am->ctrl[i] < 0) continue;
+                Value *bv = map_get(bm, am->entries[i].key);
+                if (bv == NULL || compare_values(am->entries[i].value, *bv) != ORD_EQ) return ORD_NEQ;
+            }
+            return ORD_EQ;
+        } break;
         case __VK_LENGTH:
             PANIC("unreachable");
     }
 }
 
-Value eval(AST ast, EvalContext *ctx);
-Value eval_in_ctx(AST ast, EvalContext *ctx);
-
-Value apply_fn(EvalContext *ctx, const char *name, Value fn, size_t argc, Value *argv) {
-    assert(fn.kind == VK_FUNCTION || fn.kind == VK_NATIVE_FUNCTION);
-    if (fn.kind == VK_FUNCTION) {
-        FunctionDefValue fndef = fn.value.fn;
+// JIT: integer-only functions and loops are compiled to x86-64 once they get
+// hot, everything starts out in the interpreter.  Compiled code only touches a slot array of 32 bit ints/bools, so
+// when anything goes wrong at runtime (guard failure, division by zero) it can
+// bail out and the interpreter re-runs the whole thing from scratch.
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
 
-        if (argc != fndef.params.count)
-            PANIC("Function '%s' expected %ld params, received %ld.", name, fndef.params.count, argc);
+bool jit_enabled = true; // --no-jit or LISP_NO_JIT
+bool jit_log = false; // LISP_JIT_LOG
 
-        EvalContext fn_ctx = create_ctx(ctx);
-        for (size_t i = 0; i < fndef.params.count; ++i) {
-            Value *v = add_var(&fn_ctx, fndef.params.items[i]);
-            *v = argv[i];
-        }
-        Value ret = eval_in_ctx(*fndef.body, &fn_ctx);
-        free_ctx(fn_ctx);
-        return ret;
-    } else {
-        NativeFunctionValue fndef = fn.value.native;
+// Compiling costs a few microseconds, so short scripts never pay for it.
+#define JIT_CALL_THRESHOLD 50 // calls to a function
+#define JIT_LOOP_THRESHOLD 1000 // iterations of a loop, over all of its runs
 
-        const char *reason = check_range(argc, fndef.min_args, fndef.max_args);
+typedef int (*JitEntry)(int32_t *slots);
 
-        if (reason) {
-            if (fndef.min_args == fndef.max_args)
-                PANIC("%s arguments passed to function '%s'.  Expected %ld, got %ld", reason, fndef.name, fndef.min_args, argc);
-            if (fndef.min_args <= 0)
-                PANIC("%s arguments passed to function '%s'.  Expected at most %ld, got %ld", reason, fndef.name, fndef.max_args, argc);
-            if (fndef.max_args < 0)
-                PANIC("%s arguments passed to function '%s'.  Expected at least %ld, got %ld", reason, fndef.name, fndef.min_args, argc);
-        }
+typedef struct {
+    const char *name;
+    size_t slot;
+    ValueKind kind;
+    bool written;
+} JitFreeVar;
+
+struct JitCode {
+    JitEntry entry;
+    size_t slot_count;
+    ValueKind *param_kinds;
+    size_t param_count;
+    JitFreeVar *free_vars; // looked up in the caller's context on entry
+    size_t free_count;
+    ValueKind result_kind;
+    size_t result_slot;
+};
 
-        return fndef.fn(ctx, argc, argv);
+// FUNCTION_CALL or one of the nodes infer_types specializes it into
+bool is_call(AST *ast) {
+    switch (ast->kind) {
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            return true;
+        default:
+            return false;
     }
 }
 
-Value eval_in_ctx(AST ast, EvalContext *ctx) {
-    switch (ast.kind) {
-        case __EK_LENGTH: PANIC("unreachable");
-        case EK_ATOM: {
-            switch (ast.value.atom.kind) {
-                case TK_LPAREN:
-                case TK_RPAREN:
-                case TK_PLUS:
-                case TK_MINUS:
-                case TK_STAR:
-                case TK_SLASH:
-                case TK_IF:
-                case TK_EOF:
-                case TK_EVAL:
-                case TK_FUNCTION:
-                case TK_LET:
-                case TK_EQUALS:
-                case TK_AT:
-                case TK_WHILE:
-                case TK_FOR:
-                case TK_DEQ:
-                case TK_NEQ:
-                case TK_LT:
-                case TK_GT:
-                case TK_LEQ:
-                case TK_GEQ:
-                case TK_DOT:
-                case TK_BANG:
-                case __TK_LENGTH:
-                    PANIC("unreachable: %s", token_string(ast.value.atom));
+// Whether `pred` holds for `ast` or anything evaluated as part of it.  The
+// bodies of functions defined in it aren't, they only run when called.
+bool ast_any(AST *ast, bool (*pred)(AST *ast, const void *data), const void *data) {
+    if (pred(ast, data)) return true;
+    switch (ast->kind) {
+        case EK_ATOM:
+        case EK_UNIT:
+        case EK_FUNCTION_DEF:
+        case __EK_LENGTH:
+            return false;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX: {
+            FunctionCallValue fn = ast->value.fn_call;
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                if (ast_any(&fn.args.items[i], pred, data)) return true;
+            }
+            return false;
+        }
+        case EK_IF: {
+            IfValue if_ = ast->value.if_;
+            return ast_any(if_.cond, pred, data) || ast_any(if_.true_branch, pred, data)
+                || (if_.false_branch && ast_any(if_.false_branch, pred, data));
+        }
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR: {
+            DeclareAssign dec = ast->value.declare_assign;
+            return dec.value && ast_any(dec.value, pred, data);
+        }
+        case EK_WHILE: {
+            WhileValue w = ast->value.while_;
+            for (size_t i = 0; i < w.hoisted.count; ++i) {
+                if (ast_any(&w.hoisted.items[i], pred, data)) return true;
+            }
+            return ast_any(w.cond, pred, data) || ast_any(w.body, pred, data);
+        }
+        case EK_FOR: {
+            ForValue f = ast->value.for_;
+            for (size_t i = 0; i < f.hoisted.count; ++i) {
+                if (ast_any(&f.hoisted.items[i], pred, data)) return true;
+            }
+            return ast_any(f.init, pred, data) || ast_any(f.cond, pred, data)
+                || ast_any(f.post, pred, data) || ast_any(f.body, pred, data);
+        }
+    }
+    return false;
+}
+
+bool mentions_pred(AST *ast, const void *name) {
+    if (ast->kind == EK_ATOM) return ast->value.atom.kind == TK_IDENT && ast->value.atom.value.ident == name;
+    if (ast->kind == EK_DECLARE_VAR || ast->kind == EK_ASSIGN_VAR) return ast->value.declare_assign.name == name;
+    return false;
+}
+
+// whether the variable `name` is used anywhere in `ast`
+bool ast_mentions(AST *ast, const char *name) {
+    return ast_any(ast, mentions_pred, name);
+}
+
+#ifdef JIT_SUPPORTED
+
+typedef struct {
+    const char *name;
+    size_t slot;
+    ValueKind kind;
+} JitVar;
+
+// Mirrors an EvalContext that will exist at runtime.
+typedef struct JitScope {
+    struct JitScope *parent;
+    struct {
+        JitVar *items;
+        size_t count;
+        size_t capacity;
+    } vars;
+    size_t depth; // how many branches/loops deep the scope was created
+} JitScope;
+
+typedef struct {
+    struct {
+        uint8_t *items;
+        size_t count;
+        size_t capacity;
+    } code;
+    struct {
+        size_t *items;
+        size_t count;
+        size_t capacity;
+    } bails; // rel32 offsets that jump to the bail-out stub
+    struct {
+        JitFreeVar *items;
+        size_t count;
+        size_t capacity;
+    } free_vars;
+    size_t slot_count;
+    size_t depth;
+    EvalContext *ctx; // where free variables live
+    const char *error;
+} JitCompiler;
+
+// Kinds that fit in a slot
+#define JIT_SCALAR(kind) ((kind) == VK_INT || (kind) == VK_BOOL)
+// An `if` without matching branches; only fine if the value is thrown away
+#define JIT_MIXED __VK_LENGTH
+
+#define JIT_REFUSE(jc, reason) do { \
+    (jc)->error = (reason);         \
+    return false;                   \
+} while (0)
+
+void jit_emit(JitCompiler *jc, const uint8_t *bytes, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        da_append(&jc->code, bytes[i]);
+    }
+}
+
+#define JIT_EMIT(jc, ...) do {                      \
+    const uint8_t bytes_[] = { __VA_ARGS__ };       \
+    jit_emit((jc), bytes_, sizeof(bytes_));         \
+} while (0)
+
+void jit_emit32(JitCompiler *jc, uint32_t v) {
+    JIT_EMIT(jc, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+}
+
+// mov eax, [rdi + 4*slot]
+void jit_load(JitCompiler *jc, size_t slot) {
+    JIT_EMIT(jc, 0x8b, 0x87);
+    jit_emit32(jc, slot * 4);
+}
+
+// mov [rdi + 4*slot], eax
+void jit_store(JitCompiler *jc, size_t slot) {
+    JIT_EMIT(jc, 0x89, 0x87);
+    jit_emit32(jc, slot * 4);
+}
+
+// emits a jump with opcode `op` and returns the offset of its rel32
+size_t jit_jump(JitCompiler *jc, const uint8_t *op, size_t n) {
+    jit_emit(jc, op, n);
+    size_t at = jc->code.count;
+    jit_emit32(jc, 0);
+    return at;
+}
+
+#define JIT_JZ(jc) jit_jump((jc), (const uint8_t[]) { 0x0f, 0x84 }, 2)
+#define JIT_JMP(jc) jit_jump((jc), (const uint8_t[]) { 0xe9 }, 1)
+
+void jit_patch(JitCompiler *jc, size_t at, size_t target) {
+    int32_t rel = (int32_t) (target - (at + 4));
+    memcpy(&jc->code.items[at], &rel, sizeof(rel));
+}
+
+void jit_jump_back(JitCompiler *jc, size_t target) {
+    jit_patch(jc, JIT_JMP(jc), target);
+}
+
+JitVar *jit_scope_find(JitScope *scope, const char *name) {
+    for (; scope != NULL; scope = scope->parent) {
+        for (size_t i = 0; i < scope->vars.count; ++i) {
+            if (!strcmp(scope->vars.items[i].name, name)) return &scope->vars.items[i];
+        }
+    }
+    return NULL;
+}
+
+// A variable that isn't declared in the compiled code.  It's read from the
+// context on entry, so its kind is fixed to whatever it is right now.
+JitFreeVar *jit_free_var(JitCompiler *jc, const char *name) {
+    for (size_t i = 0; i < jc->free_vars.count; ++i) {
+        if (!strcmp(jc->free_vars.items[i].name, name)) return &jc->free_vars.items[i];
+    }
+    Value *v = get_var(jc->ctx, name);
+    if (v == NULL || !JIT_SCALAR(v->kind) || v->immutable) return NULL;
+    JitFreeVar var = {
+        .name = name,
+        .slot = jc->slot_count++,
+        .kind = v->kind,
+    };
+    da_append(&jc->free_vars, var);
+    return &jc->free_vars.items[jc->free_vars.count - 1];
+}
+
+bool jit_expr(JitCompiler *jc, AST *ast, JitScope *scope, ValueKind *kind);
+
+// like `eval`, the expression gets its own scope
+bool jit_eval(JitCompiler *jc, AST *ast, JitScope *scope, ValueKind *kind) {
+    JitScope child = {
+        .parent = scope,
+        .depth = jc->depth,
+    };
+    bool ok = jit_expr(jc, ast, &child, kind);
+    free(child.vars.items);
+    return ok;
+}
+
+bool jit_eval_int(JitCompiler *jc, AST *ast, JitScope *scope) {
+    ValueKind kind;
+    if (!jit_eval(jc, ast, scope, &kind)) return false;
+    if (kind != VK_INT) JIT_REFUSE(jc, "non-integer operand");
+    return true;
+}
+
+bool jit_eval_cond(JitCompiler *jc, AST *ast, JitScope *scope) {
+    ValueKind kind;
+    if (!jit_eval(jc, ast, scope, &kind)) return false;
+    if (!JIT_SCALAR(kind)) JIT_REFUSE(jc, "condition is not an int or bool");
+    JIT_EMIT(jc, 0x85, 0xc0); // test eax, eax
+    return true;
+}
+
+// cond/body/post of a loop, whatever ran before it (the init) is already done
+bool jit_loop(JitCompiler *jc, AST *ast, JitScope *scope) {
+    AST *cond, *body, *post = NULL;
+    if (ast->kind == EK_FOR) {
+        cond = ast->value.for_.cond;
+        body = ast->value.for_.body;
+        post = ast->value.for_.post;
+    } else {
+        cond = ast->value.while_.cond;
+        body = ast->value.while_.body;
+    }
+
+    ValueKind kind;
+    jc->depth++;
+    size_t top = jc->code.count;
+    size_t exit = 0;
+    bool has_exit = post == NULL || cond->kind != EK_UNIT;
+    if (has_exit) {
+        if (!jit_eval_cond(jc, cond, scope)) return false;
+        exit = JIT_JZ(jc);
+    }
+    if (!jit_eval(jc, body, scope, &kind)) return false;
+    if (post && !jit_eval(jc, post, scope, &kind)) return false;
+    jit_jump_back(jc, top);
+    if (has_exit) jit_patch(jc, exit, jc->code.count);
+    jc->depth--;
+    return true;
+}
+
+bool jit_arith(JitCompiler *jc, Token op, ASTList args, JitScope *scope) {
+    size_t min = op.kind == TK_PLUS || op.kind == TK_STAR ? 1 : 2;
+    if (args.count < min) JIT_REFUSE(jc, "too few arguments");
+
+    if (!jit_eval_int(jc, &args.items[0], scope)) return false;
+    for (size_t i = 1; i < args.count; ++i) {
+        JIT_EMIT(jc, 0x50); // push rax
+        if (!jit_eval_int(jc, &args.items[i], scope)) return false;
+        JIT_EMIT(jc, 0x89, 0xc1); // mov ecx, eax
+        JIT_EMIT(jc, 0x58); // pop rax
+        switch (op.kind) {
+            case TK_PLUS: JIT_EMIT(jc, 0x01, 0xc8); break; // add eax, ecx
+            case TK_MINUS: JIT_EMIT(jc, 0x29, 0xc8); break; // sub eax, ecx
+            case TK_STAR: JIT_EMIT(jc, 0x0f, 0xaf, 0xc1); break; // imul eax, ecx
+            case TK_SLASH: {
+                // x / 0 and INT_MIN / -1 trap, let the interpreter deal with them
+                JIT_EMIT(jc, 0x85, 0xc9); // test ecx, ecx
+                da_append(&jc->bails, JIT_JZ(jc));
+                JIT_EMIT(jc, 0x83, 0xf9, 0xff); // cmp ecx, -1
+                size_t ok = jit_jump(jc, (const uint8_t[]) { 0x0f, 0x85 }, 2); // jne
+                JIT_EMIT(jc, 0x3d, 0x00, 0x00, 0x00, 0x80); // cmp eax, INT_MIN
+                da_append(&jc->bails, JIT_JZ(jc));
+                jit_patch(jc, ok, jc->code.count);
+                JIT_EMIT(jc, 0x99, 0xf7, 0xf9); // cdq; idiv ecx
+            } break;
+            default: PANIC("unreachable");
+        }
+    }
+    return true;
+}
+
+bool jit_compare(JitCompiler *jc, Token op, ASTList args, JitScope *scope) {
+    if (args.count != 2) JIT_REFUSE(jc, "comparison needs two arguments");
+
+    ValueKind a, b;
+    if (!jit_eval(jc, &args.items[0], scope, &a)) return false;
+    JIT_EMIT(jc, 0x50); // push rax
+    if (!jit_eval(jc, &args.items[1], scope, &b)) return false;
+    if (a != b || !JIT_SCALAR(a)) JIT_REFUSE(jc, "comparison of mismatched kinds");
+    // bools only have equality
+    if (a == VK_BOOL && op.kind != TK_DEQ && op.kind != TK_NEQ) JIT_REFUSE(jc, "ordering bools");
+    JIT_EMIT(jc, 0x89, 0xc1); // mov ecx, eax
+    JIT_EMIT(jc, 0x58); // pop rax
+    JIT_EMIT(jc, 0x39, 0xc8); // cmp eax, ecx
+
+    uint8_t setcc;
+    switch (op.kind) {
+        case TK_DEQ: setcc = 0x94; break;
+        case TK_NEQ: setcc = 0x95; break;
+        case TK_LT: setcc = 0x9c; break;
+        case TK_LEQ: setcc = 0x9e; break;
+        case TK_GT: setcc = 0x9f; break;
+        case TK_GEQ: setcc = 0x9d; break;
+        default: PANIC("unreachable");
+    }
+    JIT_EMIT(jc, 0x0f, setcc, 0xc0); // setcc al
+    JIT_EMIT(jc, 0x0f, 0xb6, 0xc0); // movzx eax, al
+    return true;
+}
+
+// like `eval_in_ctx`: leaves the value (if any) in eax
+bool jit_expr(JitCompiler *jc, AST *ast, JitScope *scope, ValueKind *kind) {
+    *kind = VK_UNIT;
+    switch (ast->kind) {
+        case EK_ATOM: {
+            Token atom = ast->value.atom;
+            switch (atom.kind) {
                 case TK_INT:
-                    return (Value) {
-                        .kind = VK_INT,
-                        .value = {
-                            .integer = ast.value.atom.value.integer,
-                        }
-                    };
-                case TK_IDENT: {
-                    Value *var = get_var(ctx, ast.value.atom.value.ident);
-                    if (!var) PANIC("Variable '%s' does not exist in current scope.", ast.value.atom.value.ident);
-                    return *var;
-                } break;
+                    JIT_EMIT(jc, 0xb8); // mov eax, imm32
+                    jit_emit32(jc, atom.value.integer);
+                    *kind = VK_INT;
+                    return true;
                 case TK_TRUE:
-                case TK_FALSE: {
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = ast.value.atom.kind == TK_TRUE,
-                        }
-                    };
+                case TK_FALSE:
+                    JIT_EMIT(jc, 0xb8);
+                    jit_emit32(jc, atom.kind == TK_TRUE);
+                    *kind = VK_BOOL;
+                    return true;
+                case TK_IDENT: {
+                    const char *name = atom.value.ident;
+                    JitVar *var = jit_scope_find(scope, name);
+                    if (var != NULL) {
+                        jit_load(jc, var->slot);
+                        *kind = var->kind;
+                        return true;
+                    }
+                    JitFreeVar *free_var = jit_free_var(jc, name);
+                    if (free_var == NULL) JIT_REFUSE(jc, "variable is not an int or bool");
+                    jit_load(jc, free_var->slot);
+                    *kind = free_var->kind;
+                    return true;
                 }
-                case TK_STRING:
-                    return (Value) {
-                        .kind = VK_STRING,
-                        .value = {
-                            .string = ast.value.atom.value.string,
-                        }
-                    };
+                default:
+                    JIT_REFUSE(jc, "unsupported literal");
             }
         } break;
-        case EK_UNIT: return (Value) { 0 };
+        case EK_UNIT:
+            return true;
         case EK_FUNCTION_CALL: {
-            switch(ast.value.fn_call.op.kind) {
-                case TK_EOF:
-                case TK_LPAREN:
-                case TK_RPAREN:
-                case TK_INT:
-                case TK_STRING:
-                case TK_IF:
-                case TK_TRUE:
-                case TK_FALSE:
-                case TK_FUNCTION:
-                case TK_LET:
-                case TK_EQUALS:
-                case TK_WHILE:
-                case TK_FOR:
-                case __TK_LENGTH:
-                    PANIC("unreachable");
-
-                case TK_BANG: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 1) {
-                        PANIC("Expected one arguments to !, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    if (!coerce(&arg0, VK_BOOL)) PANIC("Cannot convert type %s to BOOL", vk_names[arg0.kind]);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = !arg0.value.integer,
-                        }
-                    };
-                } break;
-                case TK_DEQ: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = !compare_values(arg0, arg1),
-                        }
-                    };
-                } break;
-                case TK_NEQ: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = compare_values(arg0, arg1), // EQ is 0, everything else is nonzero
-                        }
-                    };
-                } break;
-                case TK_LT: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = compare_values(arg0, arg1) == ORD_LESS,
-                        }
-                    };
-                } break;
-                case TK_GT: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = compare_values(arg0, arg1) == ORD_GREATER,
-                        }
-                    };
-                } break;
-                case TK_LEQ: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    Ordering ord = compare_values(arg0, arg1);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = ord == ORD_LESS || ord == ORD_EQ,
-                        }
-                    };
-                } break;
-                case TK_GEQ: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
+            FunctionCallValue fn = ast->value.fn_call;
+            switch (fn.op.kind) {
+                case TK_EVAL:
+                    if (fn.args.count < 1) JIT_REFUSE(jc, "empty eval");
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        if (!jit_eval(jc, &fn.args.items[i], scope, kind)) return false;
                     }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
-                    Ordering ord = compare_values(arg0, arg1);
-                    return (Value) {
-                        .kind = VK_BOOL,
-                        .value = {
-                            .integer = ord == ORD_GREATER || ord == ORD_EQ,
-                        }
-                    };
-                } break;
+                    return true;
+                case TK_PLUS:
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                    *kind = VK_INT;
+                    return jit_arith(jc, fn.op, fn.args, scope);
+                case TK_DEQ:
+                case TK_NEQ:
+                case TK_LT:
+                case TK_LEQ:
+                case TK_GT:
+                case TK_GEQ:
+                    *kind = VK_BOOL;
+                    return jit_compare(jc, fn.op, fn.args, scope);
+                case TK_BANG:
+                    if (fn.args.count != 1) JIT_REFUSE(jc, "! needs one argument");
+                    if (!jit_eval_cond(jc, &fn.args.items[0], scope)) return false;
+                    JIT_EMIT(jc, 0x0f, 0x94, 0xc0); // sete al
+                    JIT_EMIT(jc, 0x0f, 0xb6, 0xc0); // movzx eax, al
+                    *kind = VK_BOOL;
+                    return true;
+                default:
+                    JIT_REFUSE(jc, "function call");
+            }
+        } break;
+        case EK_IF: {
+            IfValue if_ = ast->value.if_;
+            if (!jit_eval_cond(jc, if_.cond, scope)) return false;
+            size_t to_false = JIT_JZ(jc);
+            ValueKind true_kind, false_kind = VK_UNIT;
+            jc->depth++;
+            if (!jit_eval(jc, if_.true_branch, scope, &true_kind)) return false;
+            size_t to_end = JIT_JMP(jc);
+            jit_patch(jc, to_false, jc->code.count);
+            if (if_.false_branch && !jit_eval(jc, if_.false_branch, scope, &false_kind)) return false;
+            jit_patch(jc, to_end, jc->code.count);
+            jc->depth--;
+            *kind = true_kind == false_kind ? true_kind : JIT_MIXED;
+            return true;
+        } break;
+        case EK_DECLARE_VAR: {
+            DeclareAssign dec = ast->value.declare_assign;
+            JitScope *target = scope->parent;
+            if (target == NULL) JIT_REFUSE(jc, "declaration outside of the compiled code");
+            // the variable would be declared more than once, or only sometimes
+            if (target->depth != jc->depth) JIT_REFUSE(jc, "declaration inside a branch or loop");
+            for (size_t i = 0; i < target->vars.count; ++i) {
+                if (!strcmp(target->vars.items[i].name, dec.name)) JIT_REFUSE(jc, "variable declared twice");
+            }
+            // the variable exists (as UNIT) while its value is evaluated
+            if (dec.value == NULL || ast_mentions(dec.value, dec.name)) JIT_REFUSE(jc, "variable without a value");
+
+            ValueKind value_kind;
+            if (!jit_eval(jc, dec.value, scope, &value_kind)) return false;
+            if (!JIT_SCALAR(value_kind)) JIT_REFUSE(jc, "variable is not an int or bool");
+            JitVar var = {
+                .name = dec.name,
+                .slot = jc->slot_count++,
+                .kind = value_kind,
+            };
+            jit_store(jc, var.slot);
+            da_append(&target->vars, var);
+            return true;
+        } break;
+        case EK_ASSIGN_VAR: {
+            DeclareAssign ass = ast->value.declare_assign;
+            if (scope->parent == NULL) JIT_REFUSE(jc, "assignment outside of the compiled code");
+            size_t slot;
+            JitFreeVar *free_var = NULL;
+            JitVar *var = jit_scope_find(scope->parent, ass.name);
+            if (var != NULL) {
+                slot = var->slot;
+                *kind = var->kind;
+            } else {
+                free_var = jit_free_var(jc, ass.name);
+                if (free_var == NULL) JIT_REFUSE(jc, "variable is not an int or bool");
+                slot = free_var->slot;
+                *kind = free_var->kind;
+                free_var->written = true;
+            }
+
+            ValueKind value_kind;
+            if (!jit_eval(jc, ass.value, scope, &value_kind)) return false;
+            if (value_kind != *kind) JIT_REFUSE(jc, "assignment changes the kind of a variable");
+            jit_store(jc, slot);
+            return true;
+        } break;
+        case EK_WHILE: {
+            ASTList hoisted = ast->value.while_.hoisted;
+            for (size_t i = 0; i < hoisted.count; ++i) {
+                if (!jit_eval(jc, &hoisted.items[i], scope, kind)) return false;
+            }
+            return jit_loop(jc, ast, scope);
+        } break;
+        case EK_FOR: {
+            ASTList hoisted = ast->value.for_.hoisted;
+            if (!jit_eval(jc, ast->value.for_.init, scope, kind)) return false;
+            for (size_t i = 0; i < hoisted.count; ++i) {
+                if (!jit_eval(jc, &hoisted.items[i], scope, kind)) return false;
+            }
+            *kind = VK_UNIT;
+            return jit_loop(jc, ast, scope);
+        } break;
+        case EK_INT_ARITH:
+            *kind = VK_INT;
+            return jit_arith(jc, ast->value.fn_call.op, ast->value.fn_call.args, scope);
+        case EK_INT_COMPARE:
+            *kind = VK_BOOL;
+            return jit_compare(jc, ast->value.fn_call.op, ast->value.fn_call.args, scope);
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            JIT_REFUSE(jc, "strings and arrays");
+        case EK_FUNCTION_DEF:
+            JIT_REFUSE(jc, "function definition");
+        case __EK_LENGTH:
+            PANIC("unreachable");
+    }
+    PANIC("unreachable");
+}
+
+// Compiled code is kept in chunks that are only writable while code is copied in.
+typedef struct {
+    uint8_t *base;
+    size_t used;
+    size_t capacity;
+} JitArena;
+
+static JitArena jit_arena;
+
+#define JIT_CHUNK_SIZE (1 << 20)
+
+void *jit_install(const uint8_t *code, size_t size) {
+    if (jit_arena.base == NULL || jit_arena.used + size > jit_arena.capacity) {
+        size_t capacity = size > JIT_CHUNK_SIZE ? size : JIT_CHUNK_SIZE;
+        void *base = mmap(NULL, capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+        jit_arena = (JitArena) { .base = base, .capacity = capacity };
+    }
+
+    if (mprotect(jit_arena.base, jit_arena.capacity, PROT_READ | PROT_WRITE)) return NULL;
+    void *entry = jit_arena.base + jit_arena.used;
+    memcpy(entry, code, size);
+    jit_arena.used += (size + 15) & ~(size_t) 15;
+    if (mprotect(jit_arena.base, jit_arena.capacity, PROT_READ | PROT_EXEC)) return NULL;
+    return entry;
+}
+
+// `root` is the context the code runs in, `params` are already declared in it.
+JitCode *jit_compile(const char *what, AST *ast, EvalContext *ctx, ParamList *params, Value *argv) {
+    JitCompiler jc = {
+        .ctx = ctx,
+    };
+    JitScope root = { 0 };
+    JitCode *code = NULL;
+
+    if (params != NULL) {
+        for (size_t i = 0; i < params->count; ++i) {
+            if (!JIT_SCALAR(argv[i].kind)) {
+                jc.error = "parameter is not an int or bool";
+                goto done;
+            }
+            JitVar var = {
+                .name = params->items[i],
+                .slot = jc.slot_count++,
+                .kind = argv[i].kind,
+            };
+            da_append(&root.vars, var);
+        }
+    }
+
+    JIT_EMIT(&jc, 0x55); // push rbp
+    JIT_EMIT(&jc, 0x48, 0x89, 0xe5); // mov rbp, rsp
+
+    ValueKind kind = VK_UNIT;
+    bool ok = params != NULL ? jit_expr(&jc, ast, &root, &kind) : jit_loop(&jc, ast, &root);
+    if (!ok) goto done;
+    if (kind == JIT_MIXED) {
+        jc.error = "result has more than one kind";
+        goto done;
+    }
+
+    size_t result_slot = jc.slot_count++;
+    if (kind != VK_UNIT) jit_store(&jc, result_slot);
+    JIT_EMIT(&jc, 0x31, 0xc0); // xor eax, eax
+    JIT_EMIT(&jc, 0xc9, 0xc3); // leave; ret
+    for (size_t i = 0; i < jc.bails.count; ++i) {
+        jit_patch(&jc, jc.bails.items[i], jc.code.count);
+    }
+    JIT_EMIT(&jc, 0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+    JIT_EMIT(&jc, 0xc9, 0xc3); // leave; ret
+
+    void *entry = jit_install(jc.code.items, jc.code.count);
+    if (entry == NULL) {
+        jc.error = "could not map executable memory";
+        goto done;
+    }
+
+    code = malloc(sizeof(JitCode));
+    *code = (JitCode) {
+        .entry = (JitEntry) entry,
+        .slot_count = jc.slot_count,
+        .param_count = params != NULL ? params->count : 0,
+        .free_vars = jc.free_vars.items,
+        .free_count = jc.free_vars.count,
+        .result_kind = kind,
+        .result_slot = result_slot,
+    };
+    code->param_kinds = malloc(code->param_count * sizeof(ValueKind) + 1);
+    for (size_t i = 0; i < code->param_count; ++i) {
+        code->param_kinds[i] = argv[i].kind;
+    }
+    if (jit_log) fprintf(stderr, "[JIT] compiled %s (%ld bytes, %ld slots)\n", what, jc.code.count, jc.slot_count);
+
+done:
+    if (code == NULL) {
+        if (jit_log) fprintf(stderr, "[JIT] cannot compile %s: %s\n", what, jc.error);
+        free(jc.free_vars.items);
+    }
+    free(root.vars.items);
+    free(jc.code.items);
+    free(jc.bails.items);
+    return code;
+}
+
+// Runs the code, `slots` already holds the params.  Returns false if the
+// interpreter has to do it instead; nothing has been changed in that case.
+bool jit_run(JitCode *code, EvalContext *ctx, int32_t *slots) {
+    Value *vars[code->free_count + 1];
+    for (size_t i = 0; i < code->free_count; ++i) {
+        JitFreeVar fv = code->free_vars[i];
+        vars[i] = get_var(ctx, fv.name);
+        if (vars[i] == NULL || vars[i]->kind != fv.kind) return false;
+        slots[fv.slot] = vars[i]->value.integer;
+    }
+
+    if (code->entry(slots) != 0) return false;
+
+    for (size_t i = 0; i < code->free_count; ++i) {
+        if (code->free_vars[i].written) vars[i]->value.integer = slots[code->free_vars[i].slot];
+    }
+    return true;
+}
+
+bool jit_call_function(FunctionDefValue *fn, EvalContext *ctx, size_t argc, Value *argv, Value *ret) {
+    JitSlot *slot = fn->jit;
+    if (!jit_enabled || slot == NULL || slot->failed) return false;
+    if (slot->code == NULL) {
+        if (++slot->hotness < JIT_CALL_THRESHOLD) return false;
+        slot->code = jit_compile("function", fn->body, ctx, &fn->params, argv);
+        if (slot->code == NULL) {
+            slot->failed = true;
+            return false;
+        }
+    }
+
+    JitCode *code = slot->code;
+    int32_t slots[code->slot_count];
+    for (size_t i = 0; i < argc; ++i) {
+        if (argv[i].kind != code->param_kinds[i]) return false;
+        slots[i] = argv[i].value.integer;
+    }
+    if (!jit_run(code, ctx, slots)) return false;
+
+    *ret = (Value) { .kind = code->result_kind };
+    if (code->result_kind != VK_UNIT) ret->value.integer = slots[code->result_slot];
+    return true;
+}
+
+// Called by the interpreter at the top of every iteration of the WHILE/FOR
+// `ast` running in `ctx`.  Once the loop is hot the rest of it is run by
+// compiled code, all of the loop's state is in `ctx` at that point.  Clears
+// `keep_trying` when this run of the loop should stay in the interpreter.
+bool jit_run_loop(JitSlot *slot, AST *ast, EvalContext *ctx, bool *keep_trying) {
+    if (!*keep_trying) return false;
+    if (!jit_enabled || slot == NULL || slot->failed) {
+        *keep_trying = false;
+        return false;
+    }
+    if (slot->code == NULL) {
+        if (++slot->hotness < JIT_LOOP_THRESHOLD) return false;
+        slot->code = jit_compile("loop", ast, ctx, NULL, NULL);
+        if (slot->code == NULL) {
+            slot->failed = true;
+            *keep_trying = false;
+            return false;
+        }
+    }
+
+    int32_t slots[slot->code->slot_count];
+    if (jit_run(slot->code, ctx, slots)) return true;
+    *keep_trying = false;
+    return false;
+}
+
+#else // JIT_SUPPORTED
+
+bool jit_call_function(FunctionDefValue *fn, EvalContext *ctx, size_t argc, Value *argv, Value *ret) {
+    return false;
+}
+
+bool jit_run_loop(JitSlot *slot, AST *ast, EvalContext *ctx, bool *keep_trying) {
+    *keep_trying = false;
+    return false;
+}
+
+#endif // JIT_SUPPORTED
+
+Value eval(AST ast, EvalContext *ctx);
+Value eval_in_ctx(AST ast, EvalContext *ctx);
+
+// Heap profiler (--heap-profile): every block allocated while the script
+// runs is counted for the node being evaluated (see profile_eval), and for
+// the kind of value that node made.  A snapshot of the sites holding the
+// most memory is written every HEAP_SNAPSHOT_EVERY bytes and at exit.
+// Values are never freed, so live bytes only go down when buffers are
+// grown or scopes end.
+#define HEAP_SNAPSHOT_EVERY (64 << 20)
+#define HEAP_TOP 20 // sites in a snapshot
+#define HEAP_MIXED -2 // site made values of different kinds
+#define HEAP_UNKNOWN -1 // site hasn't finished evaluating yet
+#define HEAP_SCOPE -3 // site made UNIT, so what it allocated are variables
+
+typedef struct {
+    uint32_t line, col;
+    char *label; // what the node is, e.g. `let s` or `append`
+    int kind; // of the value the node made, or one of the HEAP_ ones
+    size_t live, total, allocs;
+} HeapSite;
+
+typedef struct {
+    void *ptr;
+    size_t size;
+    size_t site;
+} HeapBlock;
+
+// what profile_eval keeps for the node it's running
+typedef struct {
+    AST *node;
+    size_t site; // SIZE_MAX until it allocates
+} HeapNode;
+
+bool heap_profiling = false; // --heap-profile
+static const char *heap_path;
+static FILE *heap_out;
+static HeapSite *heap_sites;
+static size_t heap_site_count, heap_site_capacity;
+static HeapBlock *heap_blocks; // open addressing by pointer
+static size_t heap_block_count, heap_block_capacity;
+static HeapNode heap_node = { NULL, SIZE_MAX };
+static size_t heap_allocated, heap_next_snapshot, heap_snapshots;
+
+static inline size_t heap_slot(void *ptr, size_t capacity) {
+    return hash_mix((uintptr_t) ptr) & (capacity - 1);
+}
+
+void heap_label(AST *ast, char *buf, size_t n) {
+    if (ast == NULL) {
+        snprintf(buf, n, "(outside of the script)");
+        return;
+    }
+    switch (ast->kind) {
+        case EK_DECLARE_VAR:
+            snprintf(buf, n, "let %s", ast->value.declare_assign.name);
+            return;
+        case EK_ASSIGN_VAR:
+            snprintf(buf, n, "= %s", ast->value.declare_assign.name);
+            return;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX: {
+            Token op = ast->value.fn_call.op;
+            const char *name;
+            switch (op.kind) {
+                case TK_IDENT: name = op.value.ident; break;
+                case TK_PLUS: name = "+"; break;
+                case TK_MINUS: name = "-"; break;
+                case TK_STAR: name = "*"; break;
+                case TK_SLASH: name = "/"; break;
+                case TK_AT: name = "@"; break;
+                case TK_DOT: name = "."; break;
+                case TK_EVAL: name = "eval"; break;
+                default: name = tk_names[op.kind]; break;
+            }
+            snprintf(buf, n, "%s", name);
+            return;
+        }
+        case EK_ATOM:
+            snprintf(buf, n, "%s", ast->value.atom.kind == TK_IDENT ? ast->value.atom.value.ident : tk_names[ast->value.atom.kind]);
+            return;
+        case EK_UNIT: snprintf(buf, n, "()"); return;
+        case EK_FUNCTION_DEF: snprintf(buf, n, "function"); return;
+        case EK_IF: snprintf(buf, n, "if"); return;
+        case EK_WHILE: snprintf(buf, n, "while"); return;
+        case EK_FOR: snprintf(buf, n, "for"); return;
+        case __EK_LENGTH: PANIC("unreachable");
+    }
+}
+
+size_t heap_site(AST *ast) {
+    uint32_t line = ast ? ast->line : 0, col = ast ? ast->col : 0;
+    for (size_t i = 0; i < heap_site_count; ++i) {
+        if (heap_sites[i].line == line && heap_sites[i].col == col) return i;
+    }
+    if (heap_site_count == heap_site_capacity) {
+        heap_site_capacity = heap_site_capacity ? heap_site_capacity * 2 : 64;
+        heap_sites = (realloc)(heap_sites, heap_site_capacity * sizeof(HeapSite));
+        assert(heap_sites != NULL && "Buy more RAM lol");
+    }
+    char label[128];
+    heap_label(ast, label, sizeof(label));
+    heap_sites[heap_site_count] = (HeapSite) { .line = line, .col = col, .label = strdup(label), .kind = HEAP_UNKNOWN };
+    return heap_site_count++;
+}
+
+int heap_by_live(const void *a, const void *b) {
+    const HeapSite *x = a, *y = b;
+    if (x->live != y->live) return x->live < y->live ? 1 : -1;
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return x->line != y->line ? (x->line > y->line) - (x->line < y->line) : (x->col > y->col) - (x->col < y->col);
+}
+
+void heap_snapshot(const char *when) {
+    HeapSite *sites = (malloc)(heap_site_count * sizeof(HeapSite) + 1);
+    assert(sites != NULL && "Buy more RAM lol");
+    memcpy(sites, heap_sites, heap_site_count * sizeof(HeapSite));
+    qsort(sites, heap_site_count, sizeof(HeapSite), heap_by_live);
+
+    size_t live = 0;
+    for (size_t i = 0; i < heap_site_count; ++i) live += sites[i].live;
+    fprintf(heap_out, "# snapshot %ld (%s): %.1fKB live, %.1fKB allocated\n",
+            ++heap_snapshots, when, live / 1024.0, heap_allocated / 1024.0);
+    fprintf(heap_out, "%12s %12s %10s  %-16s %s\n", "live_kb", "total_kb", "allocs", "kind", "site");
+    for (size_t i = 0; i < heap_site_count && i < HEAP_TOP; ++i) {
+        HeapSite site = sites[i];
+        const char *kind = site.kind == HEAP_MIXED ? "MIXED"
+            : site.kind == HEAP_SCOPE ? "SCOPE"
+            : site.kind == HEAP_UNKNOWN ? "?"
+            : vk_names[site.kind];
+        fprintf(heap_out, "%12.1f %12.1f %10ld  %-16s %s:%u:%u %s\n",
+                site.live / 1024.0, site.total / 1024.0, site.allocs, kind, file_name, site.line, site.col, site.label);
+    }
+    fprintf(heap_out, "\n");
+    fflush(heap_out);
+    (free)(sites);
+}
+
+void heap_track(void *ptr, size_t size) {
+    if (heap_node.site == SIZE_MAX) heap_node.site = heap_site(heap_node.node);
+    HeapSite *site = &heap_sites[heap_node.site];
+    site->live += size;
+    site->total += size;
+    site->allocs++;
+
+    if (heap_block_count * 2 >= heap_block_capacity) {
+        size_t capacity = heap_block_capacity ? heap_block_capacity * 2 : 4096;
+        HeapBlock *blocks = (calloc)(capacity, sizeof(HeapBlock));
+        assert(blocks != NULL && "Buy more RAM lol");
+        for (size_t i = 0; i < heap_block_capacity; ++i) {
+            if (heap_blocks[i].ptr == NULL) continue;
+            size_t at = heap_slot(heap_blocks[i].ptr, capacity);
+            while (blocks[at].ptr) at = (at + 1) & (capacity - 1);
+            blocks[at] = heap_blocks[i];
+        }
+        (free)(heap_blocks);
+        heap_blocks = blocks;
+        heap_block_capacity = capacity;
+    }
+    size_t at = heap_slot(ptr, heap_block_capacity);
+    while (heap_blocks[at].ptr) at = (at + 1) & (heap_block_capacity - 1);
+    heap_blocks[at] = (HeapBlock) { ptr, size, heap_node.site };
+    heap_block_count++;
+
+    heap_allocated += size;
+    if (heap_allocated >= heap_next_snapshot) {
+        heap_next_snapshot += HEAP_SNAPSHOT_EVERY;
+        heap_snapshot("periodic");
+    }
+}
+
+void heap_untrack(void *ptr) {
+    if (heap_block_capacity == 0) return;
+    size_t mask = heap_block_capacity - 1;
+    size_t at = heap_slot(ptr, heap_block_capacity);
+    for (; heap_blocks[at].ptr != ptr; at = (at + 1) & mask) {
+        // allocated before profiling started
+        if (heap_blocks[at].ptr == NULL) return;
+    }
+    heap_sites[heap_blocks[at].site].live -= heap_blocks[at].size;
+    heap_blocks[at].ptr = NULL;
+    heap_block_count--;
+    // shift back the blocks that probed past this one, so lookups don't
+    // stop early at the hole
+    for (size_t next = (at + 1) & mask; heap_blocks[next].ptr; next = (next + 1) & mask) {
+        size_t home = heap_slot(heap_blocks[next].ptr, heap_block_capacity);
+        if (((next - home) & mask) >= ((next - at) & mask)) {
+            heap_blocks[at] = heap_blocks[next];
+            heap_blocks[next].ptr = NULL;
+            at = next;
+        }
+    }
+}
+
+void *heap_malloc(size_t size) {
+    void *ptr = (malloc)(size);
+    if (heap_profiling && ptr) heap_track(ptr, size);
+    return ptr;
+}
+
+void *heap_calloc(size_t count, size_t size) {
+    void *ptr = (calloc)(count, size);
+    if (heap_profiling && ptr) heap_track(ptr, count * size);
+    return ptr;
+}
+
+void *heap_realloc(void *ptr, size_t size) {
+    if (heap_profiling && ptr) heap_untrack(ptr);
+    void *moved = (realloc)(ptr, size);
+    // the grown block is counted for whatever grew it
+    if (heap_profiling && moved) heap_track(moved, size);
+    return moved;
+}
+
+void heap_free(void *ptr) {
+    if (heap_profiling && ptr) heap_untrack(ptr);
+    (free)(ptr);
+}
+
+// called by profile_eval around every node
+static inline HeapNode heap_enter(AST *ast) {
+    HeapNode outer = heap_node;
+    heap_node = (HeapNode) { ast, SIZE_MAX };
+    return outer;
+}
+
+static inline void heap_leave(HeapNode outer, Value made) {
+    if (heap_node.site != SIZE_MAX) {
+        HeapSite *site = &heap_sites[heap_node.site];
+        int kind = made.kind == VK_UNIT ? HEAP_SCOPE : (int) made.kind;
+        if (site->kind == HEAP_UNKNOWN) site->kind = kind;
+        else if (site->kind != kind) site->kind = HEAP_MIXED;
+    }
+    heap_node = outer;
+}
+
+void heap_report(void) {
+    heap_profiling = false;
+    heap_snapshot("exit");
+    fclose(heap_out);
+}
+
+void profile_track(void);
+
+void heap_start(const char *path) {
+    heap_path = path;
+    heap_out = fopen(heap_path, "w");
+    if (!heap_out) PANIC("Could not open %s for writing: %m", heap_path);
+    profile_track();
+    heap_next_snapshot = HEAP_SNAPSHOT_EVERY;
+    heap_profiling = true;
+    atexit(heap_report);
+}
+
+// Sampling profiler (--profile): apply_fn and eval keep a stack of the
+// functions and loops being run, each with the node it's evaluating, and a
+// SIGPROF timer counts how often every stack is seen.  The signal handler
+// can't allocate, so the stacks are counted in tables allocated up front.
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 1024 // frames past this are cut off
+#define PROFILE_STACKS 16384 // distinct stacks
+#define PROFILE_FRAMES (1 << 20) // frames of all the distinct stacks
+#define PROFILE_TOP 15 // rows in the summary
+
+typedef struct {
+    const char *name; // function, "while" or "for"
+    uint32_t def_line, def_col; // where the function or loop is, 0 for natives
+    uint32_t line, col; // the node it's evaluating
+} ProfileFrame;
+
+typedef struct {
+    uint64_t hash;
+    size_t count;
+    size_t frames; // in profile_frames
+    size_t depth;
+} ProfileStack;
+
+bool profiling = false; // --profile
+static const char *profile_path;
+static ProfileFrame profile_stack[PROFILE_MAX_DEPTH];
+static volatile size_t profile_depth;
+static ProfileStack *profile_stacks;
+static ProfileFrame *profile_frames;
+static size_t profile_frame_count;
+static volatile size_t profile_samples, profile_dropped;
+
+static inline void profile_push(const char *name, uint32_t line, uint32_t col) {
+    size_t depth = profile_depth;
+    if (depth < PROFILE_MAX_DEPTH) profile_stack[depth] = (ProfileFrame) { name, line, col, line, col };
+    // the handler may only see the frame once it's written
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    profile_depth = depth + 1;
+}
+
+static inline void profile_pop(void) {
+    profile_depth = profile_depth - 1;
+}
+
+void profile_sample(int sig) {
+    (void) sig;
+    size_t depth = profile_depth;
+    if (depth > PROFILE_MAX_DEPTH) depth = PROFILE_MAX_DEPTH;
+    size_t size = depth * sizeof(ProfileFrame);
+    uint64_t hash = hash_bytes((const char *) profile_stack, size);
+    profile_samples = profile_samples + 1;
+
+    for (size_t n = 0, i = hash % PROFILE_STACKS; n < PROFILE_STACKS; ++n, i = (i + 1) % PROFILE_STACKS) {
+        ProfileStack *stack = &profile_stacks[i];
+        if (stack->count == 0) {
+            if (profile_frame_count + depth > PROFILE_FRAMES) break;
+            memcpy(&profile_frames[profile_frame_count], profile_stack, size);
+            *stack = (ProfileStack) { hash, 1, profile_frame_count, depth };
+            profile_frame_count += depth;
+            return;
+        }
+        if (stack->hash == hash && stack->depth == depth && !memcmp(&profile_frames[stack->frames], profile_stack, size)) {
+            stack->count++;
+            return;
+        }
+    }
+    profile_dropped = profile_dropped + 1;
+}
+
+// Runs a node like eval, with the innermost frame pointing at it meanwhile.
+// Loops get a frame of their own.
+Value profile_eval(AST ast, EvalContext *parent_ctx) {
+    size_t depth = profile_depth;
+    ProfileFrame *frame = depth > 0 && depth <= PROFILE_MAX_DEPTH ? &profile_stack[depth - 1] : NULL;
+    uint32_t line = 0, col = 0;
+    if (frame && ast.line != 0) {
+        line = frame->line;
+        col = frame->col;
+        frame->line = ast.line;
+        frame->col = ast.col;
+    }
+    bool loop = ast.kind == EK_WHILE || ast.kind == EK_FOR;
+    if (loop) profile_push(ast.kind == EK_WHILE ? "while" : "for", ast.line, ast.col);
+    HeapNode outer;
+    if (heap_profiling) outer = heap_enter(&ast);
+
+    EvalContext ctx = create_ctx(parent_ctx);
+    innermost_ctx = &ctx;
+    Value ret = eval_in_ctx(ast, &ctx);
+    innermost_ctx = ctx.outer;
+    free_ctx(ctx);
+
+    if (heap_profiling) heap_leave(outer, ret);
+    if (loop) profile_pop();
+    if (frame && ast.line != 0) {
+        frame->line = line;
+        frame->col = col;
+    }
+    return ret;
+}
+
+typedef struct {
+    char *label;
+    size_t self;
+    size_t total;
+    size_t last_stack; // the last stack counted in total, plus one
+} ProfileEntry;
+
+typedef struct {
+    ProfileEntry *items;
+    size_t count;
+    size_t capacity;
+    Map *index; // label -> position in items
+} ProfileTable;
+
+ProfileEntry *profile_entry(ProfileTable *table, char *label) {
+    Value key = { .kind = VK_STRING, .value.string = { .items = label, .count = strlen(label), .capacity = -1 } };
+    Value *at = map_get(table->index, key);
+    if (at) {
+        free(label);
+        return &table->items[at->value.integer];
+    }
+    map_put(table->index, key, (Value) { .kind = VK_INT, .value.integer = table->count });
+    da_append(table, ((ProfileEntry) { .label = label }));
+    return &table->items[table->count - 1];
+}
+
+char *profile_label(ProfileFrame *frame) {
+    char *label;
+    int n = frame->def_line
+        ? asprintf(&label, "%s@%u:%u", frame->name, frame->def_line, frame->def_col)
+        : asprintf(&label, "%s", frame->name);
+    assert(n >= 0 && "Buy more RAM lol");
+    return label;
+}
+
+char *profile_line_label(ProfileFrame *frame) {
+    char *label;
+    int n = frame->def_line
+        ? asprintf(&label, "%s@%u:%u %u:%u", frame->name, frame->def_line, frame->def_col, frame->line, frame->col)
+        : asprintf(&label, "%s", frame->name);
+    assert(n >= 0 && "Buy more RAM lol");
+    return label;
+}
+
+int profile_by_self(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    return strcmp(x->label, y->label);
+}
+
+int profile_by_total(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return strcmp(x->label, y->label);
+}
+
+// Writes the folded stacks (`frame;frame;... count`, what flamegraph.pl and
+// friends read) to the --profile file and a summary of the top functions
+// and lines to stderr.  Registered with atexit, so a PANIC still reports.
+void profile_report(void) {
+    setitimer(ITIMER_PROF, &(struct itimerval) { 0 }, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    FILE *out = fopen(profile_path, "w");
+    if (!out) {
+        fprintf(stderr, "[PROFILE] Could not open %s for writing: %m\n", profile_path);
+        return;
+    }
+
+    ProfileTable functions = { .index = new_map(0) };
+    ProfileTable lines = { .index = new_map(0) };
+    for (size_t i = 0; i < PROFILE_STACKS; ++i) {
+        ProfileStack *stack = &profile_stacks[i];
+        if (stack->count == 0) continue;
+        ProfileFrame *frames = &profile_frames[stack->frames];
+        for (size_t j = 0; j < stack->depth; ++j) {
+            char *label = profile_label(&frames[j]);
+            fprintf(out, "%s%s", j ? ";" : "", label);
+            if (frames[j].line) fprintf(out, ";%u:%u", frames[j].line, frames[j].col);
+
+            ProfileEntry *fn = profile_entry(&functions, label);
+            // recursive functions are in the stack more than once
+            if (fn->last_stack != i + 1) fn->total += stack->count;
+            fn->last_stack = i + 1;
+            if (j + 1 == stack->depth) {
+                fn->self += stack->count;
+                profile_entry(&lines, profile_line_label(&frames[j]))->self += stack->count;
+            }
+        }
+        fprintf(out, " %ld\n", stack->count);
+    }
+    fclose(out);
+
+    size_t samples = profile_samples;
+    fprintf(stderr, "[PROFILE] %ld samples every %dus, %ld dropped, folded stacks in %s\n",
+            samples, PROFILE_INTERVAL_US, profile_dropped, profile_path);
+    if (samples == 0) return;
+
+    qsort(functions.items, functions.count, sizeof(*functions.items), profile_by_total);
+    fprintf(stderr, "%7s %7s  %s\n", "self", "total", "function");
+    for (size_t i = 0; i < functions.count && i < PROFILE_TOP; ++i) {
+        ProfileEntry e = functions.items[i];
+        fprintf(stderr, "%6.1f%% %6.1f%%  %s\n", 100.0 * e.self / samples, 100.0 * e.total / samples, e.label);
+    }
+    qsort(lines.items, lines.count, sizeof(*lines.items), profile_by_self);
+    fprintf(stderr, "%7s  %s\n", "self", "line");
+    for (size_t i = 0; i < lines.count && i < PROFILE_TOP; ++i) {
+        ProfileEntry e = lines.items[i];
+        fprintf(stderr, "%6.1f%%  %s\n", 100.0 * e.self / samples, e.label);
+    }
+}
+
+// keeps the stack up to date, for the sampling or the heap profiler
+void profile_track(void) {
+    if (profiling) return;
+    // the script is the outermost frame
+    profile_push(file_name, 0, 0);
+    profiling = true;
+}
+
+void profile_start(const char *path) {
+    profile_path = path;
+    profile_stacks = calloc(PROFILE_STACKS, sizeof(ProfileStack));
+    profile_frames = calloc(PROFILE_FRAMES, sizeof(ProfileFrame));
+    assert(profile_stacks != NULL && profile_frames != NULL && "Buy more RAM lol");
+    profile_track();
+    atexit(profile_report);
+
+    struct sigaction action = { .sa_handler = profile_sample, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) PANIC("Could not install the profiler: %m");
+    struct timeval interval = { .tv_usec = PROFILE_INTERVAL_US };
+    if (setitimer(ITIMER_PROF, &(struct itimerval) { interval, interval }, NULL) != 0) {
+        PANIC("Could not start the profiler: %m");
+    }
+}
+
+// Call tracing (--trace-calls): exact call counts and times of every function
+// called through apply_fn.  User functions are anonymous values, so they're
+// told apart by their body, and named after the `let` that binds them.  Times
+// are read from the TSC where there is one and turned into ns at the end.
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t trace_clock(void) {
+    return __rdtsc();
+}
+#else
+static inline uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+typedef struct {
+    const void *key; // body of a user function, name of a native
+    const char *name;
+    uint32_t line, col; // of the body, 0 for natives
+    size_t calls;
+    size_t depth, max_depth;
+    uint64_t inclusive, exclusive; // in clock ticks
+} TraceEntry;
+
+typedef struct {
+    TraceEntry *items;
+    size_t count;
+    size_t capacity;
+} TraceEntries;
+
+typedef struct {
+    size_t entry;
+    uint64_t start;
+    uint64_t children; // time spent in the calls it made
+} TraceFrame;
+
+typedef struct {
+    TraceFrame *items;
+    size_t count;
+    size_t capacity;
+} TraceStack;
+
+bool tracing = false; // --trace-calls
+static const char *trace_path;
+static TraceEntries trace_entries;
+static size_t *trace_index; // position in trace_entries plus one, by key
+static size_t trace_index_capacity;
+static TraceStack trace_stack;
+static uint64_t trace_start_clock;
+static struct timespec trace_start_time;
+
+size_t trace_find(const void *key, const char *name, uint32_t line, uint32_t col) {
+    if (trace_entries.count * 2 >= trace_index_capacity) {
+        size_t capacity = trace_index_capacity ? trace_index_capacity * 2 : 256;
+        size_t *index = calloc(capacity, sizeof(size_t));
+        assert(index != NULL && "Buy more RAM lol");
+        for (size_t i = 0; i < trace_entries.count; ++i) {
+            size_t at = hash_mix((uintptr_t) trace_entries.items[i].key) & (capacity - 1);
+            while (index[at]) at = (at + 1) & (capacity - 1);
+            index[at] = i + 1;
+        }
+        free(trace_index);
+        trace_index = index;
+        trace_index_capacity = capacity;
+    }
+
+    size_t at = hash_mix((uintptr_t) key) & (trace_index_capacity - 1);
+    for (; trace_index[at]; at = (at + 1) & (trace_index_capacity - 1)) {
+        if (trace_entries.items[trace_index[at] - 1].key == key) return trace_index[at] - 1;
+    }
+    da_append(&trace_entries, ((TraceEntry) { .key = key, .name = name, .line = line, .col = col }));
+    trace_index[at] = trace_entries.count;
+    return trace_entries.count - 1;
+}
+
+void trace_enter(const void *key, const char *name, uint32_t line, uint32_t col) {
+    size_t i = trace_find(key, name, line, col);
+    TraceEntry *e = &trace_entries.items[i];
+    e->calls++;
+    if (++e->depth > e->max_depth) e->max_depth = e->depth;
+    // the clock is read last, so the bookkeeping isn't counted for the callee
+    da_append(&trace_stack, ((TraceFrame) { .entry = i, .start = trace_clock() }));
+}
+
+void trace_exit(void) {
+    uint64_t now = trace_clock();
+    TraceFrame frame = trace_stack.items[--trace_stack.count];
+    uint64_t elapsed = now - frame.start;
+    TraceEntry *e = &trace_entries.items[frame.entry];
+    e->exclusive += elapsed - frame.children;
+    // the outermost call of a recursive function already covers the others
+    if (--e->depth == 0) e->inclusive += elapsed;
+    if (trace_stack.count) trace_stack.items[trace_stack.count - 1].children += elapsed;
+}
+
+int trace_by_exclusive(const void *a, const void *b) {
+    const TraceEntry *x = a, *y = b;
+    if (x->exclusive != y->exclusive) return x->exclusive < y->exclusive ? 1 : -1;
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+// Writes a row per function called, the ones that took the most time of
+// their own first.  Registered with atexit, calls that are still running
+// (after a PANIC) count until now.
+void trace_report(void) {
+    while (trace_stack.count) trace_exit();
+    uint64_t ticks = trace_clock() - trace_start_clock;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ns = (now.tv_sec - trace_start_time.tv_sec) * 1e9 + (now.tv_nsec - trace_start_time.tv_nsec);
+    double ms_per_tick = ticks ? ns / ticks / 1e6 : 0;
+
+    FILE *out = fopen(trace_path, "w");
+    if (!out) {
+        fprintf(stderr, "[TRACE] Could not open %s for writing: %m\n", trace_path);
+        return;
+    }
+    qsort(trace_entries.items, trace_entries.count, sizeof(*trace_entries.items), trace_by_exclusive);
+    fprintf(out, "# %.3fms traced\n", ns / 1e6);
+    fprintf(out, "%12s %14s %14s %10s  %s\n", "calls", "inclusive_ms", "exclusive_ms", "max_depth", "function");
+    for (size_t i = 0; i < trace_entries.count; ++i) {
+        TraceEntry e = trace_entries.items[i];
+        if (e.calls == 0) continue;
+        fprintf(out, "%12ld %14.3f %14.3f %10ld  %s", e.calls, e.inclusive * ms_per_tick, e.exclusive * ms_per_tick, e.max_depth, e.name);
+        if (e.line) fprintf(out, "@%u:%u", e.line, e.col);
+        fprintf(out, "\n");
+    }
+    fclose(out);
+}
+
+// registers the names functions are bound to, before they're first called
+bool trace_names_pred(AST *ast, const void *data) {
+    if (ast->kind == EK_FUNCTION_DEF) {
+        ast_any(ast->value.fn_def.body, trace_names_pred, data);
+    } else if (ast->kind == EK_DECLARE_VAR || ast->kind == EK_ASSIGN_VAR) {
+        AST *value = ast->value.declare_assign.value;
+        if (value && value->kind == EK_FUNCTION_DEF) {
+            AST *body = value->value.fn_def.body;
+            trace_find(body, ast->value.declare_assign.name, body->line, body->col);
+        }
+    }
+    return false;
+}
+
+void trace_start(AST *ast, const char *path) {
+    trace_path = path;
+    ast_any(ast, trace_names_pred, NULL);
+    tracing = true;
+    atexit(trace_report);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start_time);
+    trace_start_clock = trace_clock();
+}
+
+// Hardware counters (--perf FILE): counted with perf_event_open from right
+// before the script runs until it exits, and written to FILE as a line of
+// JSON.  Counters the kernel or the machine doesn't allow are null, the
+// script runs either way.
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} PerfCounter;
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+#ifdef __linux__
+static PerfCounter perf_counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+    { "l1d_misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1 },
+    { "llc_misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL), -1 },
+};
+#else
+static PerfCounter perf_counters[] = {
+    { "cycles" }, { "instructions" }, { "branch_misses" }, { "l1d_misses" }, { "llc_misses" },
+};
+#endif
+
+#define PERF_COUNTER_COUNT (sizeof(perf_counters) / sizeof(*perf_counters))
+
+static const char *perf_path;
+static int perf_error; // errno of the first counter that couldn't be opened
+
+// the count so far, scaled up if the kernel had to share the hardware
+// between counters, or -1
+int64_t perf_read(PerfCounter *counter) {
+    uint64_t values[3]; // value, time enabled, time running
+    if (counter->fd < 0 || read(counter->fd, values, sizeof(values)) != sizeof(values)) return -1;
+    if (values[2] == 0) return values[1] == 0 ? (int64_t) values[0] : -1;
+    return (int64_t) ((double) values[0] * values[1] / values[2]);
+}
+
+void perf_report(void) {
+    int64_t counts[PERF_COUNTER_COUNT];
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        counts[i] = perf_read(&perf_counters[i]);
+        if (perf_counters[i].fd >= 0) close(perf_counters[i].fd);
+    }
+
+    FILE *out = fopen(perf_path, "w");
+    if (!out) {
+        fprintf(stderr, "[PERF] Could not open %s for writing: %m\n", perf_path);
+        return;
+    }
+    fprintf(out, "{");
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        if (counts[i] < 0) fprintf(out, "\"%s\": null, ", perf_counters[i].name);
+        else fprintf(out, "\"%s\": %ld, ", perf_counters[i].name, counts[i]);
+    }
+    if (counts[0] > 0 && counts[1] >= 0) fprintf(out, "\"ipc\": %.3f", (double) counts[1] / counts[0]);
+    else fprintf(out, "\"ipc\": null");
+    if (perf_error) fprintf(out, ", \"error\": \"%s\"", strerror(perf_error));
+    fprintf(out, "}\n");
+    fclose(out);
+}
+
+void perf_start(const char *path) {
+    perf_path = path;
+    atexit(perf_report);
+#ifdef __linux__
+    size_t opened = 0;
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        PerfCounter *counter = &perf_counters[i];
+        struct perf_event_attr attr = {
+            .type = counter->type,
+            .size = sizeof(attr),
+            .config = counter->config,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .disabled = 1,
+            // what's allowed without privileges, and all that's ours anyway
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counter->fd >= 0) opened++;
+        else if (perf_error == 0) perf_error = errno;
+    }
+    if (opened == 0) fprintf(stderr, "[PERF] Hardware counters are not available: %s\n", strerror(perf_error));
+    else if (perf_error) fprintf(stderr, "[PERF] Some hardware counters are not available: %s\n", strerror(perf_error));
+    // enabled last, so opening the others isn't counted
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        if (perf_counters[i].fd >= 0) ioctl(perf_counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    perf_error = ENOSYS;
+    fprintf(stderr, "[PERF] Hardware counters are only supported on Linux\n");
+#endif
+}
+
+// Where an error unwinds to, along with what has to be put back when it
+// does.  The scopes that are skipped are freed like they would have been on
+// return, which also invalidates the call caches of the names in them.
+struct ErrorHandler {
+    sigjmp_buf jmp; // without the signal mask, which costs a syscall to save
+    ErrorHandler *outer;
+    EvalContext *ctx; // innermost when the handler was pushed
+    size_t profile_depth;
+    size_t trace_depth;
+    HeapNode heap_node;
+};
+
+#define ERROR_MAX 1024
+char error_message[ERROR_MAX]; // of the error being handled
+
+// where the last function was called from in the script, for (error)
+uint32_t call_line, call_col;
+
+void error_push(ErrorHandler *handler) {
+    *handler = (ErrorHandler) {
+        .outer = error_handler,
+        .ctx = innermost_ctx,
+        .profile_depth = profile_depth,
+        .trace_depth = trace_stack.count,
+        .heap_node = heap_node,
+    };
+    error_handler = handler;
+}
+
+void error_pop(ErrorHandler *handler) {
+    assert(error_handler == handler);
+    error_handler = handler->outer;
+}
+
+_Noreturn void raise_error(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(error_message, ERROR_MAX, fmt, args);
+    va_end(args);
+
+    ErrorHandler *handler = error_handler;
+    if (handler == NULL) {
+        fprintf(stderr, "%s\n", error_message);
+        exit(1);
+    }
+    error_handler = handler->outer;
+    profile_depth = handler->profile_depth;
+    while (trace_stack.count > handler->trace_depth) trace_exit();
+    heap_node = handler->heap_node;
+    // scopes point to their callers', so the ones skipped are a chain
+    for (; innermost_ctx != handler->ctx; innermost_ctx = innermost_ctx->outer) {
+        assert(innermost_ctx != NULL);
+        free_ctx(*innermost_ctx);
+    }
+    stats.errors++;
+    siglongjmp(handler->jmp, 1);
+}
+
+Value apply_fn(EvalContext *ctx, const char *name, Value fn, size_t argc, Value *argv) {
+    assert(fn.kind == VK_FUNCTION || fn.kind == VK_NATIVE_FUNCTION);
+    if (fn.kind == VK_FUNCTION) {
+        FunctionDefValue fndef = fn.value.fn;
+
+        if (argc != fndef.params.count)
+            PANIC("Function '%s' expected %ld params, received %ld.", name, fndef.params.count, argc);
+
+        if (profiling) profile_push(name, fndef.body->line, fndef.body->col);
+        if (tracing) trace_enter(fndef.body, name, fndef.body->line, fndef.body->col);
+        Value ret;
+        if (!jit_call_function(&fndef, ctx, argc, argv, &ret)) {
+            EvalContext fn_ctx = create_ctx(ctx);
+            innermost_ctx = &fn_ctx;
+            for (size_t i = 0; i < fndef.params.count; ++i) {
+                Value *v = add_var(&fn_ctx, fndef.params.items[i]);
+                *v = argv[i];
+            }
+            ret = fndef.compiled ? fndef.compiled(&fn_ctx) : eval_in_ctx(*fndef.body, &fn_ctx);
+            innermost_ctx = fn_ctx.outer;
+            free_ctx(fn_ctx);
+        }
+        if (tracing) trace_exit();
+        if (profiling) profile_pop();
+        return ret;
+    } else {
+        NativeFunctionValue fndef = fn.value.native;
+
+        const char *reason = check_range(argc, fndef.min_args, fndef.max_args);
+        count_native_call(fndef.name);
+
+        if (reason) {
+            if (fndef.min_args == fndef.max_args)
+                PANIC("%s arguments passed to function '%s'.  Expected %ld, got %ld", reason, fndef.name, fndef.min_args, argc);
+            if (fndef.min_args <= 0)
+                PANIC("%s arguments passed to function '%s'.  Expected at most %ld, got %ld", reason, fndef.name, fndef.max_args, argc);
+            if (fndef.max_args < 0)
+                PANIC("%s arguments passed to function '%s'.  Expected at least %ld, got %ld", reason, fndef.name, fndef.min_args, argc);
+        }
+
+        if (profiling || tracing) {
+            if (profiling) profile_push(fndef.name, 0, 0);
+            if (tracing) trace_enter(fndef.name, fndef.name, 0, 0);
+            Value ret = fndef.bound ? fndef.bound(fndef.data, ctx, argc, argv) : fndef.fn(ctx, argc, argv);
+            if (tracing) trace_exit();
+            if (profiling) profile_pop();
+            return ret;
+        }
+        if (fndef.bound) return fndef.bound(fndef.data, ctx, argc, argv);
+        return fndef.fn(ctx, argc, argv);
+    }
+}
+
+// Runs a FOR loop found by optimize_loops (whose init and hoisted variables
+// have run), unless the counter or bound turn out not to be ints.
+bool eval_counted(AST *ast, EvalContext *ctx) {
+    ForValue f = ast->value.for_;
+    CountedLoop *loop = f.counted;
+    Value *var = get_var(ctx, loop->var);
+    Value bound = eval(*loop->bound, ctx);
+    if (var == NULL || var->kind != VK_INT || bound.kind != VK_INT) return false;
+
+    int n = bound.value.integer;
+    bool jit = true;
+    for (;;) {
+        if (jit_run_loop(f.jit, ast, ctx, &jit)) break;
+        int i = var->value.integer;
+        bool more;
+        switch (loop->cmp) {
+            case TK_LT: more = i < n; break;
+            case TK_LEQ: more = i <= n; break;
+            case TK_GT: more = i > n; break;
+            case TK_GEQ: more = i >= n; break;
+            default: PANIC("unreachable");
+        }
+        if (!more) break;
+        eval(*f.body, ctx);
+        var->value.integer += loop->step;
+    }
+    return true;
+}
+
+// Operand of a node specialized by infer_types, which proved it's an int.
+// Literals and variables don't need a scope of their own to be evaluated in.
+// (op a b) for the comparison operators, b is converted to a's kind first
+Value compare_op(TokenKind op, Value arg0, Value arg1) {
+    if (!coerce(&arg1, arg0.kind)) PANIC("Cannot compare type %s to type %s", vk_names[arg1.kind], vk_names[arg0.kind]);
+    Ordering ord = compare_values(arg0, arg1);
+    int out;
+    switch (op) {
+        case TK_DEQ: out = !ord; break;
+        case TK_NEQ: out = ord; break; // EQ is 0, everything else is nonzero
+        case TK_LT: out = ord == ORD_LESS; break;
+        case TK_GT: out = ord == ORD_GREATER; break;
+        case TK_LEQ: out = ord == ORD_LESS || ord == ORD_EQ; break;
+        case TK_GEQ: out = ord == ORD_GREATER || ord == ORD_EQ; break;
+        default: PANIC("unreachable");
+    }
+    return (Value) {
+        .kind = VK_BOOL,
+        .value = {
+            .integer = out,
+        }
+    };
+}
+
+// (. a n)
+Value index_value(Value arg0, Value arg1) {
+    switch (arg0.kind) {
+        case VK_UNIT:
+        case VK_INT:
+        case VK_BOOL:
+        case VK_FUNCTION:
+        case VK_CHAR:
+        case VK_NATIVE_FUNCTION:
+        case VK_READER:
+        case VK_MAP:
+            PANIC("Cannot index into %s", vk_names[arg0.kind]);
+        case VK_STRING: {
+            String string = arg0.value.string;
+            if (arg1.kind != VK_INT) PANIC("Cannot index into %s with type %s", vk_names[arg0.kind], vk_names[arg1.kind]);
+            int n = arg1.value.integer;
+            if (n < 0 || n >= string.count) PANIC("Index %d out of bounds for length %ld", n, string.count);
+            return (Value) {
+                .kind = VK_CHAR,
+                .value = {
+                    .character = string.items[n],
+                },
+            };
+        } break;
+        case VK_ARRAY: {
+            ValueArray array = arg0.value.array;
+            if (arg1.kind != VK_INT) PANIC("Cannot index into %s with type %s", vk_names[arg0.kind], vk_names[arg1.kind]);
+            int n = arg1.value.integer;
+            if (n < 0 || n >= array.count) PANIC("Index %d out of bounds for length %ld", n, array.count);
+            return array.items[n];
+        } break;
+        case __VK_LENGTH:
+            break;
+    }
+    PANIC("unreachable");
+}
+
+// The function called by name at a call site, see CallCache.
+Value lookup_fn(EvalContext *ctx, const char *name, CallCache *cache) {
+    if (cache->version != SYMBOL(name)->version) {
+        Value *var = get_var(ctx, name);
+        if (var == NULL) {
+            PANIC("Unknown function '%s'", name);
+        }
+        if (var->kind != VK_FUNCTION && var->kind != VK_NATIVE_FUNCTION) {
+            PANIC("Variable '%s' is not a function.", name);
+        }
+        cache->fn = *var;
+        cache->version = SYMBOL(name)->version;
+    }
+    return cache->fn;
+}
+
+int eval_int(AST *ast, EvalContext *ctx) {
+    if (ast->kind == EK_ATOM) {
+        Token atom = ast->value.atom;
+        if (atom.kind == TK_INT) return atom.value.integer;
+        if (atom.kind == TK_IDENT) {
+            Value *var = get_var(ctx, atom.value.ident);
+            if (!var) PANIC("Variable '%s' does not exist in current scope.", atom.value.ident);
+            return var->value.integer;
+        }
+    }
+    return eval(*ast, ctx).value.integer;
+}
+
+Value eval_in_ctx(AST ast, EvalContext *ctx) {
+    stats.evals[ast.kind]++;
+    switch (ast.kind) {
+        case __EK_LENGTH: PANIC("unreachable");
+        case EK_ATOM: {
+            switch (ast.value.atom.kind) {
+                case TK_LPAREN:
+                case TK_RPAREN:
+                case TK_PLUS:
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                case TK_IF:
+                case TK_EOF:
+                case TK_EVAL:
+                case TK_FUNCTION:
+                case TK_LET:
+                case TK_EQUALS:
+                case TK_AT:
+                case TK_WHILE:
+                case TK_FOR:
+                case TK_DEQ:
+                case TK_NEQ:
+                case TK_LT:
+                case TK_GT:
+                case TK_LEQ:
+                case TK_GEQ:
+                case TK_DOT:
+                case TK_BANG:
+                case __TK_LENGTH:
+                    PANIC("unreachable: %s", token_string(ast.value.atom));
+                case TK_INT:
+                    return (Value) {
+                        .kind = VK_INT,
+                        .value = {
+                            .integer = ast.value.atom.value.integer,
+                        }
+                    };
+                case TK_IDENT: {
+                    Value *var = get_var(ctx, ast.value.atom.value.ident);
+                    if (!var) PANIC("Variable '%s' does not exist in current scope.", ast.value.atom.value.ident);
+                    return *var;
+                } break;
+                case TK_TRUE:
+                case TK_FALSE: {
+                    return (Value) {
+                        .kind = VK_BOOL,
+                        .value = {
+                            .integer = ast.value.atom.kind == TK_TRUE,
+                        }
+                    };
+                }
+                case TK_STRING:
+                    return (Value) {
+                        .kind = VK_STRING,
+                        .value = {
+                            .string = ast.value.atom.value.string,
+                        }
+                    };
+            }
+        } break;
+        case EK_UNIT: return (Value) { 0 };
+        case EK_FUNCTION_CALL: {
+            switch(ast.value.fn_call.op.kind) {
+                case TK_EOF:
+                case TK_LPAREN:
+                case TK_RPAREN:
+                case TK_INT:
+                case TK_STRING:
+                case TK_IF:
+                case TK_TRUE:
+                case TK_FALSE:
+                case TK_FUNCTION:
+                case TK_LET:
+                case TK_EQUALS:
+                case TK_WHILE:
+                case TK_FOR:
+                case __TK_LENGTH:
+                    PANIC("unreachable");
+
+                case TK_BANG: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count != 1) {
+                        PANIC("Expected one arguments to !, got %ld", fn.args.count);
+                    }
+                    Value arg0 = eval(fn.args.items[0], ctx);
+                    if (!coerce(&arg0, VK_BOOL)) PANIC("Cannot convert type %s to BOOL", vk_names[arg0.kind]);
+                    return (Value) {
+                        .kind = VK_BOOL,
+                        .value = {
+                            .integer = !arg0.value.integer,
+                        }
+                    };
+                } break;
+                case TK_DEQ:
+                case TK_NEQ:
+                case TK_LT:
+                case TK_GT:
+                case TK_LEQ:
+                case TK_GEQ: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count != 2) {
+                        PANIC("Expected two arguments, got %ld", fn.args.count);
+                    }
+                    Value arg0 = eval(fn.args.items[0], ctx);
+                    Value arg1 = eval(fn.args.items[1], ctx);
+                    return compare_op(fn.op.kind, arg0, arg1);
+                } break;
+
+                case TK_DOT: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count != 2) {
+                        PANIC("Expected two arguments, got %ld", fn.args.count);
+                    }
+                    Value arg0 = eval(fn.args.items[0], ctx);
+                    Value arg1 = eval(fn.args.items[1], ctx);
+                    return index_value(arg0, arg1);
+                } break;
+                case TK_AT: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    Value ret = {
+                        .kind = VK_ARRAY,
+                        .value = {
+                            .array = { 0 },
+                        },
+                    };
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        da_append(&ret.value.array, eval(fn.args.items[i], ctx));
+                    }
+                    return ret;
+                } break;
+                case TK_EVAL: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count < 1) PANIC("Eval operation must have at least on expression");
+                    Value ret = { 0 };
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        ret = eval(fn.args.items[i], ctx);
+                    }
+                    return ret;
+                } break;
+                case TK_PLUS: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count < 1) PANIC("Add operation must contain at least one value.");
+                    Value out = { 0 };
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        add_value(&out, eval(fn.args.items[i], ctx));
+                    }
+                    return out;
+                } break;
+                case TK_MINUS: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count < 2) PANIC("Subtract operation must contain at least two values.");
+                    Value out = eval(fn.args.items[0], ctx);
+                    for (size_t i = 1; i < fn.args.count; ++i) {
+                        sub_value(&out, eval(fn.args.items[i], ctx));
+                    }
+                    return out;
+                } break;
+                case TK_STAR: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count < 1) PANIC("Multiply operation must contain at least one value.");
+                    Value out = {
+                        .kind = VK_INT,
+                        .value = {
+                            .integer = 1,
+                        },
+                    };
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        mult_value(&out, eval(fn.args.items[i], ctx));
+                    }
+                    return out;
+                } break;
+                case TK_SLASH: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    if (fn.args.count < 2) PANIC("Subtract operation must contain at least two values.");
+                    Value out = eval(fn.args.items[0], ctx);
+                    for (size_t i = 1; i < fn.args.count; ++i) {
+                        div_value(&out, eval(fn.args.items[i], ctx));
+                    }
+                    return out;
+                } break;
+                case TK_IDENT: {
+                    FunctionCallValue fn = ast.value.fn_call;
+                    const char *name = fn.op.value.ident;
+                    Value callee = lookup_fn(ctx, name, fn.cache);
+                    Value args[fn.args.count];
+                    for (size_t i = 0; i < fn.args.count; ++i) {
+                        args[i] = eval(fn.args.items[i], ctx);
+                    }
+                    call_line = ast.line;
+                    call_col = ast.col;
+                    return apply_fn(ctx, name, callee, fn.args.count, args);
+                } break;
+            }
+        } break;
+        case EK_FOR: {
+            ForValue f = ast.value.for_;
+            eval(*f.init, ctx);
+            for (size_t i = 0; i < f.hoisted.count; ++i) {
+                eval(f.hoisted.items[i], ctx);
+            }
+            if (f.counted && eval_counted(&ast, ctx)) return (Value) { 0 };
+            bool jit = true;
+            for (;;) {
+                if (jit_run_loop(f.jit, &ast, ctx, &jit)) break;
+                // if condition is (), then we pretend it's `true`, like C does.
+                if (f.cond->kind != EK_UNIT) {
+                    Value cond = eval(*f.cond, ctx);
+                    if (!value_to_bool(cond)) break;
+                }
+                eval(*f.body, ctx);
+                eval(*f.post, ctx);
+            }
+
+            return (Value) { 0 };
+        } break;
+        case EK_WHILE: {
+            WhileValue w = ast.value.while_;
+            for (size_t i = 0; i < w.hoisted.count; ++i) {
+                eval(w.hoisted.items[i], ctx);
+            }
+            bool jit = true;
+            for (;;) {
+                if (jit_run_loop(w.jit, &ast, ctx, &jit)) break;
+                Value cond = eval(*w.cond, ctx);
+                if (!value_to_bool(cond)) break;
+                eval(*w.body, ctx);
+            }
+
+            return (Value) { 0 };
+        } break;
+        case EK_IF: {
+            IfValue if_ = ast.value.if_;
+            Value cond = eval(*if_.cond, ctx);
+            if (value_to_bool(cond)) {
+                return eval(*if_.true_branch, ctx);
+            }
+
+            if (if_.false_branch) {
+                return eval(*if_.false_branch, ctx);
+            }
+
+            return (Value) { 0 };
+        } break;
+        case EK_INT_ARITH: {
+            FunctionCallValue fn = ast.value.fn_call;
+            int out = eval_int(&fn.args.items[0], ctx);
+            for (size_t i = 1; i < fn.args.count; ++i) {
+                int n = eval_int(&fn.args.items[i], ctx);
+                switch (fn.op.kind) {
+                    case TK_PLUS: out += n; break;
+                    case TK_MINUS: out -= n; break;
+                    case TK_STAR: out *= n; break;
+                    case TK_SLASH: out = div_int(out, n); break;
+                    default: PANIC("unreachable");
+                }
+            }
+            return (Value) {
+                .kind = VK_INT,
+                .value.integer = out,
+            };
+        } break;
+        case EK_INT_COMPARE: {
+            FunctionCallValue fn = ast.value.fn_call;
+            int a = eval_int(&fn.args.items[0], ctx);
+            int b = eval_int(&fn.args.items[1], ctx);
+            bool out;
+            switch (fn.op.kind) {
+                case TK_DEQ: out = a == b; break;
+                case TK_NEQ: out = a != b; break;
+                case TK_LT: out = a < b; break;
+                case TK_LEQ: out = a <= b; break;
+                case TK_GT: out = a > b; break;
+                case TK_GEQ: out = a >= b; break;
+                default: PANIC("unreachable");
+            }
+            return (Value) {
+                .kind = VK_BOOL,
+                .value.integer = out,
+            };
+        } break;
+        case EK_STRING_CONCAT: {
+            FunctionCallValue fn = ast.value.fn_call;
+            Value out = eval(fn.args.items[0], ctx);
+            for (size_t i = 1; i < fn.args.count; ++i) {
+                format_value((Sink) { .string = &out.value.string }, eval(fn.args.items[i], ctx));
+            }
+            return out;
+        } break;
+        case EK_ARRAY_INDEX: {
+            FunctionCallValue fn = ast.value.fn_call;
+            ValueArray array = eval(fn.args.items[0], ctx).value.array;
+            int n = eval_int(&fn.args.items[1], ctx);
+            if (n < 0 || n >= array.count) PANIC("Index %d out of bounds for length %ld", n, array.count);
+            return array.items[n];
+        } break;
+        case EK_FUNCTION_DEF: {
+            return (Value) {
+                .kind = VK_FUNCTION,
+                .value.fn = ast.value.fn_def,
+            };
+        } break;
+        case EK_DECLARE_VAR: {
+            DeclareAssign dec = ast.value.declare_assign;
+            Value *var = add_var(ctx->parent, dec.name);
+            if (dec.value) {
+                *var = eval(*dec.value, ctx);
+            }
+            return (Value) { 0 };
+        } break;
+        case EK_ASSIGN_VAR: {
+            DeclareAssign ass = ast.value.declare_assign;
+            Value *var = get_var(ctx->parent, ass.name);
+            if (var == NULL) {
+                PANIC("Variable '%s' does not exist in ctx.", ass.name);
+            }
+            if (var->immutable) {
+                PANIC("Variable '%s' is immutable.", ass.name);
+            }
+            *var = eval(*ass.value, ctx);
+            // after the value, which may have cached the old one
+            SYMBOL(ass.name)->version++;
+            return *var;
+        } break;
+    }
+    PANIC("Unknown expression kind: '%s'", ek_names[ast.kind]);
+}
+
+Value eval(AST ast, EvalContext *parent_ctx) {
+    if (profiling) return profile_eval(ast, parent_ctx);
+    EvalContext ctx = create_ctx(parent_ctx);
+    innermost_ctx = &ctx;
+    Value ret = eval_in_ctx(ast, &ctx);
+    innermost_ctx = ctx.outer;
+    free_ctx(ctx);
+    return ret;
+}
+
+// Optimizer: runs between parse() and eval().  It folds operators applied to
+// literals, drops `if` branches that can never be taken and flattens nested
+// `eval`s.  Every expression gets a scope of its own and `let` declares into
+// the one above it, so a node is only moved into a different scope when that
+// can't change where anything is declared or looked up.
+bool opt_enabled = true; // --no-opt
+bool inline_enabled = true; // off for --trace-calls, inlined functions are never called
+
+bool is_literal(AST *ast) {
+    if (ast->kind != EK_ATOM) return false;
+    TokenKind kind = ast->value.atom.kind;
+    return kind == TK_INT || kind == TK_STRING || kind == TK_TRUE || kind == TK_FALSE;
+}
+
+bool is_literal_kind(AST *ast, TokenKind kind) {
+    if (!is_literal(ast)) return false;
+    TokenKind lit = ast->value.atom.kind;
+    if (kind == TK_TRUE || kind == TK_FALSE) return lit == TK_TRUE || lit == TK_FALSE;
+    return lit == kind;
+}
+
+bool is_declare(AST *ast) {
+    return ast != NULL && ast->kind == EK_DECLARE_VAR;
+}
+
+// Whether running `ast` directly in a scope behaves differently from running
+// it in a fresh child of that scope, i.e. whether it declares into or assigns
+// from the scope above the one it runs in.
+bool scope_sensitive(AST *ast) {
+    switch (ast->kind) {
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            return true;
+        case EK_FUNCTION_CALL: {
+            ASTList args = ast->value.fn_call.args;
+            for (size_t i = 0; i < args.count; ++i) {
+                if (is_declare(&args.items[i])) return true;
+            }
+            return false;
+        }
+        case EK_IF:
+            return is_declare(ast->value.if_.cond) || is_declare(ast->value.if_.true_branch)
+                || is_declare(ast->value.if_.false_branch);
+        case EK_WHILE:
+            return is_declare(ast->value.while_.cond) || is_declare(ast->value.while_.body)
+                || ast->value.while_.hoisted.count > 0;
+        case EK_FOR:
+            return ast->value.for_.hoisted.count > 0
+                || is_declare(ast->value.for_.init) || is_declare(ast->value.for_.cond)
+                || is_declare(ast->value.for_.post) || is_declare(ast->value.for_.body);
+        default:
+            return false;
+    }
+}
+
+// whether evaluating the (literal) arguments of `fn` can't fail
+bool can_fold(FunctionCallValue fn) {
+    ASTList args = fn.args;
+    for (size_t i = 0; i < args.count; ++i) {
+        if (!is_literal(&args.items[i])) return false;
+    }
+
+    switch (fn.op.kind) {
+        case TK_PLUS:
+            if (args.count < 1) return false;
+            // strings take anything
+            if (is_literal_kind(&args.items[0], TK_STRING)) return true;
+            // fallthrough
+        case TK_STAR:
+        case TK_MINUS:
+            if (args.count < (fn.op.kind == TK_MINUS ? 2 : 1)) return false;
+            for (size_t i = 0; i < args.count; ++i) {
+                if (!is_literal_kind(&args.items[i], TK_INT)) return false;
+            }
+            return true;
+        case TK_SLASH: {
+            if (args.count < 2) return false;
+            for (size_t i = 0; i < args.count; ++i) {
+                if (!is_literal_kind(&args.items[i], TK_INT)) return false;
+            }
+            int n = args.items[0].value.atom.value.integer;
+            for (size_t i = 1; i < args.count; ++i) {
+                int d = args.items[i].value.atom.value.integer;
+                if (d == 0 || (d == -1 && n == INT_MIN)) return false;
+                n /= d;
+            }
+            return true;
+        }
+        case TK_DEQ:
+        case TK_NEQ:
+        case TK_LT:
+        case TK_LEQ:
+        case TK_GT:
+        case TK_GEQ:
+            return args.count == 2 && is_literal_kind(&args.items[1], args.items[0].value.atom.kind);
+        case TK_BANG:
+            return args.count == 1 && !is_literal_kind(&args.items[0], TK_STRING);
+        default:
+            return false;
+    }
+}
+
+AST literal_from_value(Value v) {
+    Token tok = { 0 };
+    switch (v.kind) {
+        case VK_INT:
+            tok = (Token) { .kind = TK_INT, .value.integer = v.value.integer };
+            break;
+        case VK_BOOL:
+            tok = (Token) { .kind = v.value.integer ? TK_TRUE : TK_FALSE };
+            break;
+        case VK_STRING:
+            tok = (Token) { .kind = TK_STRING, .value.string = v.value.string };
+            // shared by every evaluation of the literal now
+            tok.value.string.capacity = -1;
+            break;
+        default:
+            PANIC("unreachable");
+    }
+    return (AST) {
+        .kind = EK_ATOM,
+        .value.atom = tok,
+    };
+}
+
+// (eval ...) gets the args of nested evals that don't declare anything, and
+// is replaced by its only argument if that can't tell the difference.
+void flatten_eval(AST *ast) {
+    ASTList args = ast->value.fn_call.args;
+    ASTList flat = { 0 };
+    for (size_t i = 0; i < args.count; ++i) {
+        AST *arg = &args.items[i];
+        bool nested = arg->kind == EK_FUNCTION_CALL && arg->value.fn_call.op.kind == TK_EVAL;
+        if (nested) {
+            ASTList inner = arg->value.fn_call.args;
+            for (size_t j = 0; j < inner.count; ++j) {
+                if (is_declare(&inner.items[j])) nested = false;
+            }
+        }
+        if (nested) {
+            ASTList inner = arg->value.fn_call.args;
+            for (size_t j = 0; j < inner.count; ++j) {
+                da_append(&flat, inner.items[j]);
+            }
+        } else {
+            da_append(&flat, *arg);
+        }
+    }
+    ast->value.fn_call.args = flat;
+
+    if (flat.count == 1 && !scope_sensitive(&flat.items[0])) {
+        *ast = flat.items[0];
+    }
+}
+
+// value_to_bool of an int or bool literal
+bool const_cond(AST *ast, bool *value) {
+    if (!is_literal(ast) || ast->value.atom.kind == TK_STRING) return false;
+    Token atom = ast->value.atom;
+    *value = atom.kind == TK_TRUE || (atom.kind == TK_INT && atom.value.integer != 0);
+    return true;
+}
+
+void optimize(AST *ast) {
+    bool cond;
+    switch (ast->kind) {
+        case EK_ATOM:
+        case EK_UNIT:
+        case __EK_LENGTH:
+            break;
+        // only made by infer_types, which runs afterwards
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            break;
+        case EK_FUNCTION_DEF:
+            optimize(ast->value.fn_def.body);
+            break;
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            if (ast->value.declare_assign.value) optimize(ast->value.declare_assign.value);
+            break;
+        case EK_WHILE:
+            optimize(ast->value.while_.cond);
+            optimize(ast->value.while_.body);
+            if (const_cond(ast->value.while_.cond, &cond) && !cond) {
+                *ast = (AST) { .kind = EK_UNIT };
+            }
+            break;
+        case EK_FOR:
+            optimize(ast->value.for_.init);
+            optimize(ast->value.for_.cond);
+            optimize(ast->value.for_.post);
+            optimize(ast->value.for_.body);
+            break;
+        case EK_IF: {
+            IfValue if_ = ast->value.if_;
+            optimize(if_.cond);
+            optimize(if_.true_branch);
+            if (if_.false_branch) optimize(if_.false_branch);
+
+            if (!const_cond(if_.cond, &cond)) break;
+            AST *branch = cond ? if_.true_branch : if_.false_branch;
+            if (branch == NULL) {
+                *ast = (AST) { .kind = EK_UNIT };
+                break;
+            }
+            // the branch used to get a scope of its own under the if's
+            ASTList args = { 0 };
+            da_append(&args, *branch);
+            *ast = (AST) {
+                .kind = EK_FUNCTION_CALL,
+                .line = ast->line,
+                .col = ast->col,
+                .value.fn_call = {
+                    .op = { .kind = TK_EVAL },
+                    .args = args,
+                },
+            };
+            flatten_eval(ast);
+        } break;
+        case EK_FUNCTION_CALL: {
+            FunctionCallValue fn = ast->value.fn_call;
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                optimize(&fn.args.items[i]);
+            }
+            if (fn.op.kind == TK_EVAL) {
+                flatten_eval(ast);
+            } else if (can_fold(fn)) {
+                AST folded = literal_from_value(eval(*ast, NULL));
+                folded.line = ast->line;
+                folded.col = ast->col;
+                *ast = folded;
+            }
+        } break;
+    }
+}
+
+// Type inference: works out which kind every variable with a given name can
+// hold.  Scoping is dynamic, so any `let`, assignment or parameter with that
+// name may be the binding a use refers to, and all of them are joined.
+// Operators whose arguments are proven to be ints (or a string, or an array)
+// are then rewritten into nodes that skip the kind checks and coercions.
+//
+// The program and every function body are walked as units of their own.
+// Each symbol remembers the units that used its type, and when the type
+// changes only those are walked again, until nothing changes any more.
+#define TY_NONE __VK_LENGTH // nothing seen yet
+#define TY_ANY (__VK_LENGTH + 1)
+
+int join_types(int a, int b) {
+    if (a == TY_NONE) return b;
+    if (b == TY_NONE) return a;
+    return a == b ? a : TY_ANY;
+}
+
+typedef struct {
+    AST *body;
+    bool queued;
+    bool walked; // the functions in it are units already
+} InferUnit;
+
+typedef struct {
+    bool rewrite; // the types are final, specialize nodes
+    size_t unit; // being walked
+    struct {
+        InferUnit *items;
+        size_t count;
+        size_t capacity;
+    } units;
+    struct {
+        size_t *items;
+        size_t count;
+        size_t capacity;
+    } queue;
+} Inference;
+
+void infer_queue(Inference *inf, size_t unit) {
+    if (inf->units.items[unit].queued) return;
+    inf->units.items[unit].queued = true;
+    da_append(&inf->queue, unit);
+}
+
+void infer_define(Inference *inf, const char *name, int type) {
+    Symbol *sym = SYMBOL(name);
+    int joined = join_types(sym->type, type);
+    if (joined == sym->type) return;
+    sym->type = joined;
+    for (size_t i = 0; i < sym->readers.count; ++i) infer_queue(inf, sym->readers.items[i]);
+    sym->readers.count = 0;
+}
+
+int infer_read(Inference *inf, const char *name) {
+    Symbol *sym = SYMBOL(name);
+    size_t n = sym->readers.count;
+    if (!inf->rewrite && (n == 0 || sym->readers.items[n - 1] != inf->unit)) da_append(&sym->readers, inf->unit);
+    return sym->type;
+}
+
+int infer(Inference *inf, AST *ast);
+bool is_native_call(AST *ast, const char *name);
+
+int infer_call(Inference *inf, AST *ast) {
+    FunctionCallValue fn = ast->value.fn_call;
+    int types[fn.args.count + 1];
+    for (size_t i = 0; i < fn.args.count; ++i) {
+        types[i] = infer(inf, &fn.args.items[i]);
+    }
+
+    bool all_int = fn.args.count > 0;
+    for (size_t i = 0; i < fn.args.count; ++i) {
+        if (types[i] != VK_INT) all_int = false;
+    }
+
+    switch (fn.op.kind) {
+        case TK_PLUS:
+            if (fn.args.count < 1) return TY_ANY;
+            if (inf->rewrite && all_int) ast->kind = EK_INT_ARITH;
+            if (inf->rewrite && types[0] == VK_STRING) ast->kind = EK_STRING_CONCAT;
+            // everything after the first argument is converted to its kind
+            return types[0] == VK_UNIT ? TY_ANY : types[0];
+        case TK_STAR:
+        case TK_MINUS:
+        case TK_SLASH:
+            if (inf->rewrite && all_int && fn.args.count >= (fn.op.kind == TK_STAR ? 1 : 2)) {
+                ast->kind = EK_INT_ARITH;
+            }
+            return VK_INT;
+        case TK_DEQ:
+        case TK_NEQ:
+        case TK_LT:
+        case TK_LEQ:
+        case TK_GT:
+        case TK_GEQ:
+            if (inf->rewrite && all_int && fn.args.count == 2) ast->kind = EK_INT_COMPARE;
+            return VK_BOOL;
+        case TK_BANG:
+            return VK_BOOL;
+        case TK_AT:
+            return VK_ARRAY;
+        case TK_DOT:
+            if (fn.args.count != 2) return TY_ANY;
+            if (inf->rewrite && types[0] == VK_ARRAY && types[1] == VK_INT) ast->kind = EK_ARRAY_INDEX;
+            return types[0] == VK_STRING ? VK_CHAR : TY_ANY;
+        case TK_EVAL:
+            return fn.args.count > 0 ? types[fn.args.count - 1] : TY_ANY;
+        case TK_IDENT:
+            infer_read(inf, fn.op.value.ident);
+            return is_native_call(ast, "length") ? VK_INT : TY_ANY;
+        default:
+            return TY_ANY;
+    }
+}
+
+int infer(Inference *inf, AST *ast) {
+    switch (ast->kind) {
+        case EK_ATOM: {
+            Token atom = ast->value.atom;
+            switch (atom.kind) {
+                case TK_INT: return VK_INT;
+                case TK_STRING: return VK_STRING;
+                case TK_TRUE:
+                case TK_FALSE: return VK_BOOL;
+                case TK_IDENT: {
+                    int type = infer_read(inf, atom.value.ident);
+                    // never declared in the program, so a native (or nothing)
+                    if (!SYMBOL(atom.value.ident)->declared) return TY_ANY;
+                    if (type == TY_NONE && inf->rewrite) return TY_ANY;
+                    return type;
+                }
+                default: return TY_ANY;
+            }
+        }
+        case EK_UNIT:
+            return VK_UNIT;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            return infer_call(inf, ast);
+        case EK_FUNCTION_DEF: {
+            FunctionDefValue fn = ast->value.fn_def;
+            for (size_t i = 0; i < fn.params.count; ++i) {
+                infer_define(inf, fn.params.items[i], TY_ANY);
+                if (inf->rewrite) SYMBOL(fn.params.items[i])->defs++;
+            }
+            if (inf->rewrite) {
+                infer(inf, fn.body);
+            } else if (!inf->units.items[inf->unit].walked) {
+                da_append(&inf->units, ((InferUnit) { .body = fn.body }));
+                infer_queue(inf, inf->units.count - 1);
+            }
+            return VK_FUNCTION;
+        }
+        case EK_IF: {
+            IfValue if_ = ast->value.if_;
+            infer(inf, if_.cond);
+            int type = infer(inf, if_.true_branch);
+            return join_types(type, if_.false_branch ? infer(inf, if_.false_branch) : VK_UNIT);
+        }
+        case EK_DECLARE_VAR: {
+            DeclareAssign dec = ast->value.declare_assign;
+            if (inf->rewrite) SYMBOL(dec.name)->defs++;
+            // the variable is UNIT until its value has been evaluated
+            if (dec.value == NULL || ast_mentions(dec.value, dec.name)) infer_define(inf, dec.name, VK_UNIT);
+            if (dec.value) infer_define(inf, dec.name, infer(inf, dec.value));
+            return VK_UNIT;
+        }
+        case EK_ASSIGN_VAR: {
+            DeclareAssign ass = ast->value.declare_assign;
+            int type = infer(inf, ass.value);
+            infer_define(inf, ass.name, type);
+            SYMBOL(ass.name)->assigned = true;
+            return type;
+        }
+        case EK_WHILE:
+            for (size_t i = 0; i < ast->value.while_.hoisted.count; ++i) {
+                infer(inf, &ast->value.while_.hoisted.items[i]);
+            }
+            infer(inf, ast->value.while_.cond);
+            infer(inf, ast->value.while_.body);
+            return VK_UNIT;
+        case EK_FOR:
+            infer(inf, ast->value.for_.init);
+            for (size_t i = 0; i < ast->value.for_.hoisted.count; ++i) {
+                infer(inf, &ast->value.for_.hoisted.items[i]);
+            }
+            infer(inf, ast->value.for_.cond);
+            infer(inf, ast->value.for_.post);
+            infer(inf, ast->value.for_.body);
+            return VK_UNIT;
+        case __EK_LENGTH:
+            PANIC("unreachable");
+    }
+    PANIC("unreachable");
+}
+
+EvalContext *resumed_ctx; // --resume
+
+bool declares_pred(AST *ast, const void *data) {
+    if (ast->kind == EK_FUNCTION_DEF) {
+        FunctionDefValue fn = ast->value.fn_def;
+        for (size_t i = 0; i < fn.params.count; ++i) SYMBOL(fn.params.items[i])->declared = true;
+        ast_any(fn.body, declares_pred, data);
+    } else if (ast->kind == EK_DECLARE_VAR || ast->kind == EK_ASSIGN_VAR) {
+        SYMBOL(ast->value.declare_assign.name)->declared = true;
+    }
+    return false;
+}
+
+void infer_types(AST *ast) {
+    for (size_t i = 0; i < SYMBOL_BUCKETS; ++i) {
+        for (Symbol *sym = symbols[i]; sym != NULL; sym = sym->next) {
+            sym->type = TY_NONE;
+            sym->assigned = false;
+            sym->declared = false;
+            sym->defs = 0;
+            sym->readers.count = 0;
+        }
+    }
+
+    // the variables of a resumed snapshot can hold anything and be assigned
+    // by its functions
+    for (size_t i = 0; resumed_ctx && i < resumed_ctx->vars.count; ++i) {
+        Symbol *sym = SYMBOL(resumed_ctx->vars.items[i].key);
+        sym->type = TY_ANY;
+        sym->assigned = true;
+        sym->declared = true;
+        sym->defs = 1;
+    }
+    // everything else the units read is known to be a native before they're
+    // walked, whichever order that's in
+    ast_any(ast, declares_pred, NULL);
+
+    Inference inf = { 0 };
+    da_append(&inf.units, ((InferUnit) { .body = ast }));
+    infer_queue(&inf, 0);
+    for (size_t i = 0; i < inf.queue.count; ++i) {
+        inf.unit = inf.queue.items[i];
+        inf.units.items[inf.unit].queued = false;
+        infer(&inf, inf.units.items[inf.unit].body);
+        inf.units.items[inf.unit].walked = true;
+    }
+    free(inf.units.items);
+    free(inf.queue.items);
+
+    inf.rewrite = true;
+    infer(&inf, ast);
+}
+
+// Loop optimizer, runs once types are known.  Parts of a loop's condition
+// that can't change while the loop runs are evaluated once before it, into
+// variables only the loop can see, and FOR loops that just count are marked
+// so the interpreter can step the counter itself.
+
+// a call to the native `name`, which the program never declares itself
+bool is_native_call(AST *ast, const char *name) {
+    if (!is_call(ast) || ast->value.fn_call.op.kind != TK_IDENT) return false;
+    const char *ident = ast->value.fn_call.op.value.ident;
+    return !strcmp(ident, name) && !SYMBOL(ident)->declared;
+}
+
+bool calls_user_code_pred(AST *ast, const void *data) {
+    if (!is_call(ast) || ast->value.fn_call.op.kind != TK_IDENT) return false;
+    const char *name = ast->value.fn_call.op.value.ident;
+    return SYMBOL(name)->declared || SYMBOL(name)->calls_back;
+}
+
+bool impure_call_pred(AST *ast, const void *data) {
+    return is_call(ast) && ast->value.fn_call.op.kind == TK_IDENT && !is_native_call(ast, "length");
+}
+
+bool binds_pred(AST *ast, const void *name) {
+    return (ast->kind == EK_DECLARE_VAR || ast->kind == EK_ASSIGN_VAR) && ast->value.declare_assign.name == name;
+}
+
+typedef struct {
+    AST *parts[3]; // what runs on every iteration
+    size_t count;
+    bool calls_user_code; // which could assign to any variable
+} LoopInfo;
+
+bool loop_binds(LoopInfo *loop, const char *name) {
+    for (size_t i = 0; i < loop->count; ++i) {
+        if (ast_any(loop->parts[i], binds_pred, name)) return true;
+    }
+    return false;
+}
+
+bool is_invariant(LoopInfo *loop, AST *ast) {
+    if (ast->kind == EK_ATOM) {
+        if (ast->value.atom.kind != TK_IDENT) return true;
+        const char *name = ast->value.atom.value.ident;
+        return !loop_binds(loop, name) && !(loop->calls_user_code && SYMBOL(name)->assigned);
+    }
+    if (!is_call(ast)) return false;
+
+    FunctionCallValue fn = ast->value.fn_call;
+    switch (fn.op.kind) {
+        case TK_PLUS:
+        case TK_MINUS:
+        case TK_STAR:
+        case TK_DEQ:
+        case TK_NEQ:
+        case TK_LT:
+        case TK_LEQ:
+        case TK_GT:
+        case TK_GEQ:
+        case TK_BANG:
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                if (!is_invariant(loop, &fn.args.items[i])) return false;
+            }
+            return true;
+        case TK_IDENT: {
+            // arrays and strings don't change length, maps do
+            if (!is_native_call(ast, "length") || fn.args.count != 1) return false;
+            AST *arg = &fn.args.items[0];
+            if (arg->kind != EK_ATOM || arg->value.atom.kind != TK_IDENT) return false;
+            int type = SYMBOL(arg->value.atom.value.ident)->type;
+            return (type == VK_ARRAY || type == VK_STRING) && is_invariant(loop, arg);
+        }
+        default:
+            return false;
+    }
+}
+
+static size_t hoisted_count;
+
+void hoist(LoopInfo *loop, AST *ast, ASTList *hoisted) {
+    // literals are as cheap as it gets already
+    if (ast->kind == EK_ATOM && ast->value.atom.kind != TK_IDENT) return;
+
+    if (is_invariant(loop, ast)) {
+        char name[32];
+        snprintf(name, sizeof(name), "%%hoist%ld", hoisted_count++);
+        const char *ident = intern(name);
+        AST *value = malloc(sizeof(AST));
+        *value = *ast;
+        AST decl = {
+            .kind = EK_DECLARE_VAR,
+            .value.declare_assign = {
+                .name = ident,
+                .value = value,
+            },
+        };
+        da_append(hoisted, decl);
+        *ast = (AST) {
+            .kind = EK_ATOM,
+            .line = ast->line,
+            .col = ast->col,
+            .value.atom = {
+                .kind = TK_IDENT,
+                .value.ident = ident,
+            },
+        };
+        return;
+    }
+
+    // operator arguments always run, unlike the branches of an if
+    if (is_call(ast) && ast->value.fn_call.op.kind != TK_IDENT) {
+        ASTList args = ast->value.fn_call.args;
+        for (size_t i = 0; i < args.count; ++i) {
+            hoist(loop, &args.items[i], hoisted);
+        }
+    }
+}
+
+bool is_ident(AST *ast, const char *name) {
+    return ast->kind == EK_ATOM && ast->value.atom.kind == TK_IDENT && ast->value.atom.value.ident == name;
+}
+
+// (for (let i a) (< i b) (= i (+ i c)) body)
+CountedLoop *find_counted_loop(LoopInfo *loop, ForValue f) {
+    if (f.init->kind != EK_DECLARE_VAR || f.init->value.declare_assign.value == NULL) return NULL;
+    const char *var = f.init->value.declare_assign.name;
+
+    if (!is_call(f.cond)) return NULL;
+    FunctionCallValue cond = f.cond->value.fn_call;
+    TokenKind cmp = cond.op.kind;
+    if (cmp != TK_LT && cmp != TK_LEQ && cmp != TK_GT && cmp != TK_GEQ) return NULL;
+    if (cond.args.count != 2 || !is_ident(&cond.args.items[0], var)) return NULL;
+    if (!is_invariant(loop, &cond.args.items[1])) return NULL;
+
+    if (f.post->kind != EK_ASSIGN_VAR || f.post->value.declare_assign.name != var) return NULL;
+    AST *next = f.post->value.declare_assign.value;
+    if (!is_call(next)) return NULL;
+    FunctionCallValue step = next->value.fn_call;
+    if (step.op.kind != TK_PLUS && step.op.kind != TK_MINUS) return NULL;
+    if (step.args.count != 2 || !is_ident(&step.args.items[0], var)) return NULL;
+    AST *by = &step.args.items[1];
+    if (by->kind != EK_ATOM || by->value.atom.kind != TK_INT) return NULL;
+
+    // the body must leave the counter alone, and must not declare straight
+    // into the loop's scope, which the interpreter keeps a pointer into
+    if (f.body->kind == EK_DECLARE_VAR) return NULL;
+    if (ast_any(f.body, binds_pred, var) || ast_any(f.body, calls_user_code_pred, NULL)) return NULL;
+
+    CountedLoop *counted = malloc(sizeof(CountedLoop));
+    *counted = (CountedLoop) {
+        .var = var,
+        .bound = &cond.args.items[1],
+        .cmp = cmp,
+        .step = step.op.kind == TK_PLUS ? by->value.atom.value.integer : -by->value.atom.value.integer,
+    };
+    return counted;
+}
+
+void optimize_loops(AST *ast) {
+    switch (ast->kind) {
+        case EK_ATOM:
+        case EK_UNIT:
+        case __EK_LENGTH:
+            break;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX:
+            for (size_t i = 0; i < ast->value.fn_call.args.count; ++i) {
+                optimize_loops(&ast->value.fn_call.args.items[i]);
+            }
+            break;
+        case EK_FUNCTION_DEF:
+            optimize_loops(ast->value.fn_def.body);
+            break;
+        case EK_IF:
+            optimize_loops(ast->value.if_.cond);
+            optimize_loops(ast->value.if_.true_branch);
+            if (ast->value.if_.false_branch) optimize_loops(ast->value.if_.false_branch);
+            break;
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            if (ast->value.declare_assign.value) optimize_loops(ast->value.declare_assign.value);
+            break;
+        case EK_WHILE: {
+            WhileValue *w = &ast->value.while_;
+            optimize_loops(w->cond);
+            optimize_loops(w->body);
+            LoopInfo loop = { .parts = { w->cond, w->body }, .count = 2 };
+            loop.calls_user_code = ast_any(w->cond, calls_user_code_pred, NULL) || ast_any(w->body, calls_user_code_pred, NULL);
+            if (!ast_any(w->cond, impure_call_pred, NULL)) hoist(&loop, w->cond, &w->hoisted);
+        } break;
+        case EK_FOR: {
+            ForValue *f = &ast->value.for_;
+            optimize_loops(f->init);
+            optimize_loops(f->cond);
+            optimize_loops(f->post);
+            optimize_loops(f->body);
+            LoopInfo loop = { .parts = { f->cond, f->post, f->body }, .count = 3 };
+            for (size_t i = 0; i < loop.count; ++i) {
+                if (ast_any(loop.parts[i], calls_user_code_pred, NULL)) loop.calls_user_code = true;
+            }
+            if (!ast_any(f->cond, impure_call_pred, NULL)) hoist(&loop, f->cond, &f->hoisted);
+            f->counted = find_counted_loop(&loop, *f);
+        } break;
+    }
+}
+
+// Inliner, runs after the first type inference.  A call to a small function
+// bound by the only `let` of its name, in a later expression of the same
+// `eval`, is replaced by its body with the parameters substituted.  Literal
+// and variable arguments are used as they are, anything else is evaluated
+// first into a renamed variable:
+//
+//     (eval (let %inlN_a arg1) (let %inlN_b arg2) body)
+//
+// The lets declare into the scope the call ran in, and the body gets a scope
+// of its own right under it, just like the function's scope used to be.
+// Only leaf functions are inlined: with dynamic scoping, anything the body
+// calls could look at its parameters by name.  Calls that run at most once,
+// outside of every loop and function, are left alone, as there's nothing to
+// gain there but the time spent copying.
+#define INLINE_BUDGET 40 // nodes in the body
+
+typedef struct {
+    const char *name;
+    FunctionDefValue fn;
+} Inlinable;
+
+typedef struct {
+    Inlinable *items;
+    size_t count;
+    size_t capacity;
+} InlinableList;
+
+static size_t inlined_count;
+
+bool function_def_pred(AST *ast, const void *data) {
+    return ast->kind == EK_FUNCTION_DEF;
+}
+
+bool count_nodes_pred(AST *ast, const void *count) {
+    ++*(size_t *) count;
+    return false;
+}
+
+bool can_inline(DeclareAssign dec) {
+    if (dec.value == NULL || dec.value->kind != EK_FUNCTION_DEF) return false;
+    Symbol *sym = SYMBOL(dec.name);
+    if (sym->defs != 1 || sym->assigned) return false;
+
+    FunctionDefValue fn = dec.value->value.fn_def;
+    size_t size = 0;
+    ast_any(fn.body, count_nodes_pred, &size);
+    if (size > INLINE_BUDGET) return false;
+    if (ast_any(fn.body, function_def_pred, NULL) || ast_any(fn.body, calls_user_code_pred, NULL)) return false;
+    for (size_t i = 0; i < fn.params.count; ++i) {
+        if (ast_any(fn.body, binds_pred, fn.params.items[i])) return false;
+    }
+    return true;
+}
+
+AST *copy_substituted_ptr(AST *ast, ParamList *params, Token *subst);
+
+// Deep copy of a (leaf) function body with its parameters substituted.  The
+// copy is made of plain calls again, infer_types runs afterwards.
+AST copy_substituted(AST *ast, ParamList *params, Token *subst) {
+    AST copy = *ast;
+    switch (ast->kind) {
+        case EK_ATOM:
+            if (ast->value.atom.kind != TK_IDENT) break;
+            for (size_t i = 0; i < params->count; ++i) {
+                if (params->items[i] == ast->value.atom.value.ident) copy.value.atom = subst[i];
+            }
+            break;
+        case EK_UNIT:
+        case EK_FUNCTION_DEF: // not in inlined bodies
+        case __EK_LENGTH:
+            break;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX: {
+            ASTList args = { 0 };
+            for (size_t i = 0; i < ast->value.fn_call.args.count; ++i) {
+                da_append(&args, copy_substituted(&ast->value.fn_call.args.items[i], params, subst));
+            }
+            copy.kind = EK_FUNCTION_CALL;
+            copy.value.fn_call.args = args;
+            if (ast->value.fn_call.cache) copy.value.fn_call.cache = new_call_cache();
+        } break;
+        case EK_IF:
+            copy.value.if_.cond = copy_substituted_ptr(ast->value.if_.cond, params, subst);
+            copy.value.if_.true_branch = copy_substituted_ptr(ast->value.if_.true_branch, params, subst);
+            copy.value.if_.false_branch = copy_substituted_ptr(ast->value.if_.false_branch, params, subst);
+            break;
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            // parameters are never bound in inlined bodies
+            copy.value.declare_assign.value = copy_substituted_ptr(ast->value.declare_assign.value, params, subst);
+            break;
+        case EK_WHILE:
+            copy.value.while_.cond = copy_substituted_ptr(ast->value.while_.cond, params, subst);
+            copy.value.while_.body = copy_substituted_ptr(ast->value.while_.body, params, subst);
+            copy.value.while_.jit = new_jit_slot();
+            break;
+        case EK_FOR:
+            copy.value.for_.init = copy_substituted_ptr(ast->value.for_.init, params, subst);
+            copy.value.for_.cond = copy_substituted_ptr(ast->value.for_.cond, params, subst);
+            copy.value.for_.post = copy_substituted_ptr(ast->value.for_.post, params, subst);
+            copy.value.for_.body = copy_substituted_ptr(ast->value.for_.body, params, subst);
+            copy.value.for_.jit = new_jit_slot();
+            break;
+    }
+    return copy;
+}
+
+AST *copy_substituted_ptr(AST *ast, ParamList *params, Token *subst) {
+    if (ast == NULL) return NULL;
+    AST *copy = malloc(sizeof(AST));
+    assert(copy != NULL && "Buy more RAM lol");
+    *copy = copy_substituted(ast, params, subst);
+    return copy;
+}
+
+// whether the argument at `i` can be used as it is instead of being evaluated
+// into a variable before the body
+bool can_substitute(ASTList args, size_t i, AST *body) {
+    AST *arg = &args.items[i];
+    if (arg->kind != EK_ATOM) return false;
+    if (arg->value.atom.kind != TK_IDENT) return true;
+    // the variable has to hold the same value when the body reads it
+    const char *name = arg->value.atom.value.ident;
+    if (ast_any(body, binds_pred, name)) return false;
+    for (size_t j = i + 1; j < args.count; ++j) {
+        if (ast_any(&args.items[j], binds_pred, name) || ast_any(&args.items[j], calls_user_code_pred, NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void inline_call(AST *ast, FunctionDefValue fn) {
+    size_t n = inlined_count++;
+    ASTList call_args = ast->value.fn_call.args;
+    Token subst[fn.params.count + 1];
+    ASTList args = { 0 };
+    for (size_t i = 0; i < fn.params.count; ++i) {
+        if (can_substitute(call_args, i, fn.body)) {
+            subst[i] = call_args.items[i].value.atom;
+            continue;
+        }
+
+        char name[MAX_IDENT_LEN + 32];
+        snprintf(name, sizeof(name), "%%inl%ld_%s", n, fn.params.items[i]);
+        subst[i] = (Token) { .kind = TK_IDENT, .value.ident = intern(name) };
+
+        AST *value = malloc(sizeof(AST));
+        assert(value != NULL && "Buy more RAM lol");
+        *value = call_args.items[i];
+        AST decl = {
+            .kind = EK_DECLARE_VAR,
+            .value.declare_assign = {
+                .name = subst[i].value.ident,
+                .value = value,
+            },
+        };
+        da_append(&args, decl);
+    }
+    da_append(&args, copy_substituted(fn.body, &fn.params, subst));
+
+    *ast = (AST) {
+        .kind = EK_FUNCTION_CALL,
+        .line = ast->line,
+        .col = ast->col,
+        .value.fn_call = {
+            .op = { .kind = TK_EVAL },
+            .args = args,
+        },
+    };
+    // fold what the arguments made constant, and drop the eval if it's empty
+    optimize(ast);
+}
+
+void inline_calls(AST *ast, InlinableList *scope, bool repeated) {
+    switch (ast->kind) {
+        case EK_ATOM:
+        case EK_UNIT:
+        case __EK_LENGTH:
+            break;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX: {
+            FunctionCallValue fn = ast->value.fn_call;
+            size_t outer = scope->count;
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                AST *arg = &fn.args.items[i];
+                inline_calls(arg, scope, repeated);
+                // visible to the rest of this eval
+                if (fn.op.kind == TK_EVAL && arg->kind == EK_DECLARE_VAR && can_inline(arg->value.declare_assign)) {
+                    Inlinable f = {
+                        .name = arg->value.declare_assign.name,
+                        .fn = arg->value.declare_assign.value->value.fn_def,
+                    };
+                    da_append(scope, f);
+                }
+            }
+            scope->count = outer;
+
+            if (fn.op.kind != TK_IDENT || !repeated) break;
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                if (fn.args.items[i].kind == EK_DECLARE_VAR) return;
+            }
+            for (size_t i = scope->count; i-- > 0;) {
+                Inlinable f = scope->items[i];
+                if (f.name != fn.op.value.ident) continue;
+                if (f.fn.params.count == fn.args.count) inline_call(ast, f.fn);
+                break;
+            }
+        } break;
+        case EK_FUNCTION_DEF:
+            inline_calls(ast->value.fn_def.body, scope, true);
+            break;
+        case EK_IF:
+            inline_calls(ast->value.if_.cond, scope, repeated);
+            inline_calls(ast->value.if_.true_branch, scope, repeated);
+            if (ast->value.if_.false_branch) inline_calls(ast->value.if_.false_branch, scope, repeated);
+            break;
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            if (ast->value.declare_assign.value) inline_calls(ast->value.declare_assign.value, scope, repeated);
+            break;
+        case EK_WHILE:
+            inline_calls(ast->value.while_.cond, scope, true);
+            inline_calls(ast->value.while_.body, scope, true);
+            break;
+        case EK_FOR:
+            inline_calls(ast->value.for_.init, scope, repeated);
+            inline_calls(ast->value.for_.cond, scope, true);
+            inline_calls(ast->value.for_.post, scope, true);
+            inline_calls(ast->value.for_.body, scope, true);
+            break;
+    }
+}
+
+// Ahead of time compilation (--emit-c): the tree is written out as a C file
+// with a function per node, doing what eval_in_ctx does for that node, which
+// then includes this file (with LISP_NO_MAIN) for everything else.  Scoping
+// and the values are the same as in the interpreter, gcc just gets to see
+// the whole program.
+
+// eval() for a node compiled by --emit-c
+static inline Value eval_compiled(Value (*node)(EvalContext *ctx), EvalContext *parent_ctx) {
+    EvalContext ctx = create_ctx(parent_ctx);
+    innermost_ctx = &ctx;
+    Value ret = node(&ctx);
+    innermost_ctx = ctx.outer;
+    free_ctx(ctx);
+    return ret;
+}
+
+typedef struct {
+    FILE *decls; // symbols, strings, caches and prototypes
+    FILE *init; // body of init_symbols()
+    FILE *funcs;
+    size_t nodes;
+    size_t statics;
+    ParamList symbols; // s0, s1, ...
+} Emitter;
+
+void emit_c_string(FILE *out, const char *s, size_t n) {
+    fputc('"', out);
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < ' ' || c >= 127) {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+size_t emit_symbol(Emitter *em, const char *ident) {
+    for (size_t i = 0; i < em->symbols.count; ++i) {
+        if (em->symbols.items[i] == ident) return i;
+    }
+    size_t n = em->symbols.count;
+    da_append(&em->symbols, ident);
+    fprintf(em->decls, "static const char *s%ld;\n", n);
+    fprintf(em->init, "    s%ld = intern(", n);
+    emit_c_string(em->init, ident, strlen(ident));
+    fprintf(em->init, ");\n");
+    return n;
+}
+
+size_t emit_node(Emitter *em, AST *ast);
+
+// declares `<type> <var>` holding the value of an int expression, like eval_int
+void emit_int(Emitter *em, FILE *f, const char *type, const char *var, AST *ast) {
+    if (ast->kind == EK_ATOM && ast->value.atom.kind == TK_INT) {
+        fprintf(f, "    %s %s = %d;\n", type, var, ast->value.atom.value.integer);
+    } else if (ast->kind == EK_ATOM && ast->value.atom.kind == TK_IDENT) {
+        size_t s = emit_symbol(em, ast->value.atom.value.ident);
+        fprintf(f, "    Value *%s_var = get_var(ctx, s%ld);\n", var, s);
+        fprintf(f, "    if (!%s_var) PANIC(\"Variable '%%s' does not exist in current scope.\", s%ld);\n", var, s);
+        fprintf(f, "    %s %s = %s_var->value.integer;\n", type, var, var);
+    } else {
+        fprintf(f, "    %s %s = eval_compiled(e%ld, ctx).value.integer;\n", type, var, emit_node(em, ast));
+    }
+}
+
+void emit_panic(FILE *f, const char *message, size_t count) {
+    fprintf(f, "    PANIC(");
+    emit_c_string(f, message, strlen(message));
+    fprintf(f, ", (size_t) %ld);\n", count);
+}
+
+void emit_call(Emitter *em, FILE *f, AST *ast) {
+    FunctionCallValue fn = ast->value.fn_call;
+    size_t args[fn.args.count + 1];
+    for (size_t i = 0; i < fn.args.count; ++i) {
+        args[i] = emit_node(em, &fn.args.items[i]);
+    }
+
+    switch (fn.op.kind) {
+        case TK_BANG:
+            if (fn.args.count != 1) {
+                emit_panic(f, "Expected one arguments to !, got %ld", fn.args.count);
+                return;
+            }
+            fprintf(f, "    Value arg0 = eval_compiled(e%ld, ctx);\n", args[0]);
+            fprintf(f, "    if (!coerce(&arg0, VK_BOOL)) PANIC(\"Cannot convert type %%s to BOOL\", vk_names[arg0.kind]);\n");
+            fprintf(f, "    return (Value) { .kind = VK_BOOL, .value.integer = !arg0.value.integer };\n");
+            break;
+        case TK_DEQ:
+        case TK_NEQ:
+        case TK_LT:
+        case TK_GT:
+        case TK_LEQ:
+        case TK_GEQ:
+        case TK_DOT:
+            if (fn.args.count != 2) {
+                emit_panic(f, "Expected two arguments, got %ld", fn.args.count);
+                return;
+            }
+            fprintf(f, "    Value arg0 = eval_compiled(e%ld, ctx);\n", args[0]);
+            fprintf(f, "    Value arg1 = eval_compiled(e%ld, ctx);\n", args[1]);
+            if (fn.op.kind == TK_DOT) {
+                fprintf(f, "    return index_value(arg0, arg1);\n");
+            } else {
+                fprintf(f, "    return compare_op(TK_%s, arg0, arg1);\n", tk_names[fn.op.kind]);
+            }
+            break;
+        case TK_AT:
+            fprintf(f, "    Value ret = { .kind = VK_ARRAY };\n");
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                fprintf(f, "    da_append(&ret.value.array, eval_compiled(e%ld, ctx));\n", args[i]);
+            }
+            fprintf(f, "    return ret;\n");
+            break;
+        case TK_EVAL:
+            if (fn.args.count < 1) {
+                emit_panic(f, "Eval operation must have at least on expression", 0);
+                return;
+            }
+            for (size_t i = 0; i + 1 < fn.args.count; ++i) {
+                fprintf(f, "    eval_compiled(e%ld, ctx);\n", args[i]);
+            }
+            fprintf(f, "    return eval_compiled(e%ld, ctx);\n", args[fn.args.count - 1]);
+            break;
+        case TK_PLUS:
+            if (fn.args.count < 1) {
+                emit_panic(f, "Add operation must contain at least one value.", 0);
+                return;
+            }
+            fprintf(f, "    Value out = { 0 };\n");
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                fprintf(f, "    add_value(&out, eval_compiled(e%ld, ctx));\n", args[i]);
+            }
+            fprintf(f, "    return out;\n");
+            break;
+        case TK_STAR:
+            if (fn.args.count < 1) {
+                emit_panic(f, "Multiply operation must contain at least one value.", 0);
+                return;
+            }
+            fprintf(f, "    Value out = { .kind = VK_INT, .value.integer = 1 };\n");
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                fprintf(f, "    mult_value(&out, eval_compiled(e%ld, ctx));\n", args[i]);
+            }
+            fprintf(f, "    return out;\n");
+            break;
+        case TK_MINUS:
+        case TK_SLASH:
+            if (fn.args.count < 2) {
+                emit_panic(f, "Subtract operation must contain at least two values.", 0);
+                return;
+            }
+            fprintf(f, "    Value out = eval_compiled(e%ld, ctx);\n", args[0]);
+            for (size_t i = 1; i < fn.args.count; ++i) {
+                fprintf(f, "    %s(&out, eval_compiled(e%ld, ctx));\n", fn.op.kind == TK_MINUS ? "sub_value" : "div_value", args[i]);
+            }
+            fprintf(f, "    return out;\n");
+            break;
+        case TK_IDENT: {
+            size_t s = emit_symbol(em, fn.op.value.ident);
+            size_t cache = em->statics++;
+            fprintf(em->decls, "static CallCache c%ld;\n", cache);
+            fprintf(f, "    Value callee = lookup_fn(ctx, s%ld, &c%ld);\n", s, cache);
+            fprintf(f, "    Value args[%ld];\n", fn.args.count + 1);
+            for (size_t i = 0; i < fn.args.count; ++i) {
+                fprintf(f, "    args[%ld] = eval_compiled(e%ld, ctx);\n", i, args[i]);
+            }
+            fprintf(f, "    call_line = %u;\n", ast->line);
+            fprintf(f, "    call_col = %u;\n", ast->col);
+            fprintf(f, "    return apply_fn(ctx, s%ld, callee, %ld, args);\n", s, fn.args.count);
+        } break;
+        default:
+            PANIC("unreachable");
+    }
+}
+
+size_t emit_node(Emitter *em, AST *ast) {
+    size_t id = em->nodes++;
+    char *text;
+    size_t length;
+    FILE *f = open_memstream(&text, &length);
+    assert(f != NULL && "Buy more RAM lol");
+    fprintf(em->decls, "static Value e%ld(EvalContext *ctx);\n", id);
+    fprintf(f, "static Value e%ld(EvalContext *ctx) {\n", id);
+
+    switch (ast->kind) {
+        case EK_ATOM: {
+            Token atom = ast->value.atom;
+            switch (atom.kind) {
+                case TK_INT:
+                    fprintf(f, "    return (Value) { .kind = VK_INT, .value.integer = %d };\n", atom.value.integer);
+                    break;
+                case TK_TRUE:
+                case TK_FALSE:
+                    fprintf(f, "    return (Value) { .kind = VK_BOOL, .value.integer = %d };\n", atom.kind == TK_TRUE);
+                    break;
+                case TK_STRING: {
+                    // writable, like the parser's strings
+                    size_t n = em->statics++;
+                    fprintf(em->decls, "static char str%ld[] = ", n);
+                    emit_c_string(em->decls, atom.value.string.items, atom.value.string.count);
+                    fprintf(em->decls, ";\n");
+                    fprintf(f, "    return (Value) { .kind = VK_STRING, .value.string = { .items = str%ld, .count = %ld, .capacity = -1 } };\n",
+                            n, atom.value.string.count);
+                } break;
+                case TK_IDENT: {
+                    size_t s = emit_symbol(em, atom.value.ident);
+                    fprintf(f, "    Value *var = get_var(ctx, s%ld);\n", s);
+                    fprintf(f, "    if (!var) PANIC(\"Variable '%%s' does not exist in current scope.\", s%ld);\n", s);
+                    fprintf(f, "    return *var;\n");
+                } break;
+                default:
+                    PANIC("unreachable: %s", token_string(atom));
+            }
+        } break;
+        case EK_UNIT:
+            fprintf(f, "    return (Value) { 0 };\n");
+            break;
+        case EK_FUNCTION_CALL:
+            emit_call(em, f, ast);
+            break;
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE: {
+            FunctionCallValue fn = ast->value.fn_call;
+            const char *op;
+            switch (fn.op.kind) {
+                case TK_PLUS: op = "+"; break;
+                case TK_MINUS: op = "-"; break;
+                case TK_STAR: op = "*"; break;
+                case TK_SLASH: op = "/"; break;
+                case TK_DEQ: op = "=="; break;
+                case TK_NEQ: op = "!="; break;
+                case TK_LT: op = "<"; break;
+                case TK_LEQ: op = "<="; break;
+                case TK_GT: op = ">"; break;
+                case TK_GEQ: op = ">="; break;
+                default: PANIC("unreachable");
+            }
+            emit_int(em, f, "int", "out", &fn.args.items[0]);
+            for (size_t i = 1; i < fn.args.count; ++i) {
+                char var[32];
+                snprintf(var, sizeof(var), "n%ld", i);
+                emit_int(em, f, "int", var, &fn.args.items[i]);
+                if (fn.op.kind == TK_SLASH) fprintf(f, "    out = div_int(out, %s);\n", var);
+                else if (ast->kind == EK_INT_ARITH) fprintf(f, "    out %s= %s;\n", op, var);
+                else fprintf(f, "    out = out %s %s;\n", op, var);
+            }
+            fprintf(f, "    return (Value) { .kind = %s, .value.integer = out };\n", ast->kind == EK_INT_ARITH ? "VK_INT" : "VK_BOOL");
+        } break;
+        case EK_STRING_CONCAT: {
+            FunctionCallValue fn = ast->value.fn_call;
+            fprintf(f, "    Value out = eval_compiled(e%ld, ctx);\n", emit_node(em, &fn.args.items[0]));
+            for (size_t i = 1; i < fn.args.count; ++i) {
+                size_t arg = emit_node(em, &fn.args.items[i]);
+                fprintf(f, "    format_value((Sink) { .string = &out.value.string }, eval_compiled(e%ld, ctx));\n", arg);
+            }
+            fprintf(f, "    return out;\n");
+        } break;
+        case EK_ARRAY_INDEX: {
+            FunctionCallValue fn = ast->value.fn_call;
+            fprintf(f, "    ValueArray array = eval_compiled(e%ld, ctx).value.array;\n", emit_node(em, &fn.args.items[0]));
+            emit_int(em, f, "int", "n", &fn.args.items[1]);
+            fprintf(f, "    if (n < 0 || n >= array.count) PANIC(\"Index %%d out of bounds for length %%ld\", n, array.count);\n");
+            fprintf(f, "    return array.items[n];\n");
+        } break;
+        case EK_FUNCTION_DEF: {
+            FunctionDefValue fn = ast->value.fn_def;
+            size_t body = emit_node(em, fn.body);
+            size_t params = em->statics++;
+            fprintf(em->decls, "static const char *p%ld[%ld];\n", params, fn.params.count + 1);
+            for (size_t i = 0; i < fn.params.count; ++i) {
+                fprintf(em->init, "    p%ld[%ld] = s%ld;\n", params, i, emit_symbol(em, fn.params.items[i]));
+            }
+            fprintf(f, "    return (Value) {\n");
+            fprintf(f, "        .kind = VK_FUNCTION,\n");
+            fprintf(f, "        .value.fn = {\n");
+            fprintf(f, "            .params = { .items = p%ld, .count = %ld, .capacity = %ld },\n", params, fn.params.count, fn.params.count);
+            fprintf(f, "            .compiled = e%ld,\n", body);
+            fprintf(f, "        },\n");
+            fprintf(f, "    };\n");
+        } break;
+        case EK_IF: {
+            IfValue if_ = ast->value.if_;
+            size_t cond = emit_node(em, if_.cond);
+            size_t true_branch = emit_node(em, if_.true_branch);
+            fprintf(f, "    if (value_to_bool(eval_compiled(e%ld, ctx))) return eval_compiled(e%ld, ctx);\n", cond, true_branch);
+            if (if_.false_branch) {
+                fprintf(f, "    return eval_compiled(e%ld, ctx);\n", emit_node(em, if_.false_branch));
+            } else {
+                fprintf(f, "    return (Value) { 0 };\n");
+            }
+        } break;
+        case EK_DECLARE_VAR: {
+            DeclareAssign dec = ast->value.declare_assign;
+            size_t s = emit_symbol(em, dec.name);
+            fprintf(f, "    Value *var = add_var(ctx->parent, s%ld);\n", s);
+            if (dec.value) fprintf(f, "    *var = eval_compiled(e%ld, ctx);\n", emit_node(em, dec.value));
+            fprintf(f, "    return (Value) { 0 };\n");
+        } break;
+        case EK_ASSIGN_VAR: {
+            DeclareAssign ass = ast->value.declare_assign;
+            size_t s = emit_symbol(em, ass.name);
+            size_t value = emit_node(em, ass.value);
+            fprintf(f, "    Value *var = get_var(ctx->parent, s%ld);\n", s);
+            fprintf(f, "    if (var == NULL) PANIC(\"Variable '%%s' does not exist in ctx.\", s%ld);\n", s);
+            fprintf(f, "    if (var->immutable) PANIC(\"Variable '%%s' is immutable.\", s%ld);\n", s);
+            fprintf(f, "    *var = eval_compiled(e%ld, ctx);\n", value);
+            fprintf(f, "    SYMBOL(s%ld)->version++;\n", s);
+            fprintf(f, "    return *var;\n");
+        } break;
+        case EK_WHILE: {
+            WhileValue w = ast->value.while_;
+            for (size_t i = 0; i < w.hoisted.count; ++i) {
+                fprintf(f, "    eval_compiled(e%ld, ctx);\n", emit_node(em, &w.hoisted.items[i]));
+            }
+            size_t cond = emit_node(em, w.cond);
+            size_t body = emit_node(em, w.body);
+            fprintf(f, "    while (value_to_bool(eval_compiled(e%ld, ctx))) eval_compiled(e%ld, ctx);\n", cond, body);
+            fprintf(f, "    return (Value) { 0 };\n");
+        } break;
+        case EK_FOR: {
+            // counted loops are left to gcc
+            ForValue l = ast->value.for_;
+            fprintf(f, "    eval_compiled(e%ld, ctx);\n", emit_node(em, l.init));
+            for (size_t i = 0; i < l.hoisted.count; ++i) {
+                fprintf(f, "    eval_compiled(e%ld, ctx);\n", emit_node(em, &l.hoisted.items[i]));
+            }
+            size_t body = emit_node(em, l.body);
+            size_t post = emit_node(em, l.post);
+            fprintf(f, "    for (;;) {\n");
+            if (l.cond->kind != EK_UNIT) {
+                fprintf(f, "        if (!value_to_bool(eval_compiled(e%ld, ctx))) break;\n", emit_node(em, l.cond));
+            }
+            fprintf(f, "        eval_compiled(e%ld, ctx);\n", body);
+            fprintf(f, "        eval_compiled(e%ld, ctx);\n", post);
+            fprintf(f, "    }\n");
+            fprintf(f, "    return (Value) { 0 };\n");
+        } break;
+        case __EK_LENGTH:
+            PANIC("unreachable");
+    }
+
+    fprintf(f, "}\n\n");
+    fclose(f);
+    fwrite(text, 1, length, em->funcs);
+    free(text);
+    return id;
+}
+
+void copy_stream(FILE *from, FILE *to) {
+    char buf[4096];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) fwrite(buf, 1, n, to);
+    fclose(from);
+}
+
+void emit_c(AST *ast, const char *source, FILE *out) {
+    Emitter em = {
+        .decls = tmpfile(),
+        .init = tmpfile(),
+        .funcs = tmpfile(),
+    };
+    if (!em.decls || !em.init || !em.funcs) PANIC("Could not create temporary file: %m");
+    size_t root = emit_node(&em, ast);
+
+    fprintf(out, "// Compiled from %s by `lisp --emit-c`, build it with lisp.c on the include path:\n", source);
+    fprintf(out, "//     gcc -O2 -I<lisp directory> -o program program.c\n");
+    fprintf(out, "#define LISP_NO_MAIN\n");
+    fprintf(out, "#include \"lisp.c\"\n\n");
+    copy_stream(em.decls, out);
+    fprintf(out, "\nvoid init_symbols(void) {\n");
+    copy_stream(em.init, out);
+    fprintf(out, "}\n\n");
+    copy_stream(em.funcs, out);
+    fprintf(out, "int main(int argc, char **argv) {\n");
+    fprintf(out, "    file_name = ");
+    emit_c_string(out, source, strlen(source));
+    fprintf(out, ";\n");
+    fprintf(out, "    init_symbols();\n");
+    fprintf(out, "    out_init(argc > 1 && !strcmp(argv[1], \"--line-buffered\"));\n");
+    fprintf(out, "    EvalContext global_ctx = create_global_ctx();\n");
+    fprintf(out, "    eval_compiled(e%ld, &global_ctx);\n", root);
+    fprintf(out, "}\n");
+}
+
+Value native_print(EvalContext *ctx, size_t argc, Value *argv) {
+    for (size_t i = 0; i < argc; ++i) {
+        if (i != 0) out_write(" ", 1);
+        format_value((Sink) { 0 }, argv[i]);
+    }
+    if (out.line_buffered) out_flush();
+    return (Value) { 0 };
+}
+
+Value native_println(EvalContext *ctx, size_t argc, Value *argv) {
+    for (size_t i = 0; i < argc; ++i) {
+        if (i != 0) out_write(" ", 1);
+        format_value((Sink) { 0 }, argv[i]);
+    }
+    out_write("\n", 1);
+    if (out.line_buffered) out_flush();
+    return (Value) { 0 };
+}
+
+Value native_flush(EvalContext *ctx, size_t argc, Value *argv) {
+    out_flush();
+    return (Value) { 0 };
+}
+
+Value native_parseint(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    Value arg = argv[0];
+    if (arg.kind != VK_STRING) {
+        PANIC("parseint accepts one string as its argument, found %s.", vk_names[arg.kind]);
+    }
+
+    // like atoi, but strings aren't necessarily terminated
+    String str = arg.value.string;
+    size_t i = 0;
+    while (i < str.count && isspace(str.items[i])) ++i;
+    bool negative = i < str.count && str.items[i] == '-';
+    if (i < str.count && (str.items[i] == '-' || str.items[i] == '+')) ++i;
+    int value = 0;
+    for (; i < str.count && isdigit(str.items[i]); ++i) {
+        value = value*10 + (str.items[i] - '0');
+    }
+    if (negative) value = -value;
+    return (Value) {
+        .kind = VK_INT,
+        .value.integer = value,
+    };
+}
+
+// opens the file named by argv[0], or stdin when there are no arguments
+int open_input(const char *fn_name, size_t argc, Value *argv) {
+    if (argc == 0) return STDIN_FILENO;
+    if (argv[0].kind != VK_STRING) PANIC("%s accepts a file name as its argument, found %s.", fn_name, vk_names[argv[0].kind]);
+    char *path = strndup(argv[0].value.string.items, argv[0].value.string.count);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) PANIC("Could not open file for reading %s: %m", path);
+    free(path);
+    return fd;
+}
+
+// reads more of the input into the reader's block, keeping the bytes that
+// haven't been handed out yet.  Returns false once the input is exhausted.
+bool reader_fill(LineReader *r) {
+    if (r->eof) return false;
+    size_t rest = r->count - r->start;
+    if (r->start == 0) {
+        // nothing points into the block yet, so a line longer than it can
+        // grow it (always leaving room for a terminator)
+        if (r->count + 1 >= r->capacity) {
+            r->items = realloc(r->items, r->capacity *= 2);
+            assert(r->items != NULL && "Buy more RAM lol");
+        }
+    } else {
+        // the lines handed out keep the old block, like values keep
+        // everything else they point to
+        size_t capacity = READER_BLOCK_SIZE;
+        while (rest + 1 >= capacity) capacity *= 2;
+        char *items = malloc(capacity);
+        assert(items != NULL && "Buy more RAM lol");
+        memcpy(items, r->items + r->start, rest);
+        r->items = items;
+        r->capacity = capacity;
+        r->start = 0;
+        r->count = rest;
+    }
+    for (;;) {
+        ssize_t n = read(r->fd, r->items + r->count, r->capacity - r->count - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            PANIC("Could not read input: %m");
+        }
+        if (n == 0) {
+            r->eof = true;
+            if (r->fd != STDIN_FILENO) close(r->fd);
+        }
+        r->count += n;
+        return n > 0;
+    }
+}
+
+bool reader_next(LineReader *r, String *line) {
+    for (;;) {
+        char *begin = r->items + r->start;
+        char *nl = memchr(begin, '\n', r->count - r->start);
+        if (nl) {
+            *nl = '\0';
+            *line = (String) {
+                .items = begin,
+                .count = nl - begin,
+                .capacity = -1,
+            };
+            r->start = nl + 1 - r->items;
+            return true;
+        }
+        if (!reader_fill(r)) break;
+    }
+    // last line without a trailing newline
+    if (r->start == r->count) return false;
+    r->items[r->count] = '\0';
+    *line = (String) {
+        .items = r->items + r->start,
+        .count = r->count - r->start,
+        .capacity = -1,
+    };
+    r->start = r->count;
+    return true;
+}
+
+LineReader *new_reader(int fd) {
+    LineReader *r = malloc(sizeof(LineReader));
+    assert(r != NULL && "Buy more RAM lol");
+    *r = (LineReader) {
+        .fd = fd,
+        .capacity = READER_BLOCK_SIZE,
+        .items = malloc(READER_BLOCK_SIZE),
+    };
+    assert(r->items != NULL && "Buy more RAM lol");
+    return r;
+}
+
+// Everything that reads stdin (readline, lines and read_all) shares this
+// reader, so none of them loses what another one has already read.
+LineReader *stdin_reader(void) {
+    static LineReader *r = NULL;
+    if (r == NULL) r = new_reader(STDIN_FILENO);
+    return r;
+}
+
+Value native_readline(EvalContext *ctx, size_t argc, Value *_argv) {
+    assert(argc == 0);
+    out_flush(); // make sure any prompt is visible
+    String line;
+    if (!reader_next(stdin_reader(), &line)) return (Value) { 0 };
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = line,
+    };
+}
+
+Value native_lines(EvalContext *ctx, size_t argc, Value *argv) {
+    return (Value) {
+        .kind = VK_READER,
+        .value.reader = argc == 0 ? stdin_reader() : new_reader(open_input("lines", argc, argv)),
+    };
+}
+
+Value native_next(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    if (argv[0].kind != VK_READER) PANIC("next accepts a reader as its argument, found %s.", vk_names[argv[0].kind]);
+    String line;
+    if (!reader_next(argv[0].value.reader, &line)) return (Value) { 0 };
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = line,
+    };
+}
+
+Value native_done(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    if (argv[0].kind != VK_READER) PANIC("done accepts a reader as its argument, found %s.", vk_names[argv[0].kind]);
+    LineReader *r = argv[0].value.reader;
+    bool done = r->start == r->count && !reader_fill(r);
+    return (Value) {
+        .kind = VK_BOOL,
+        .value.integer = done,
+    };
+}
+
+ssize_t read_input(int fd, char *buf, size_t n) {
+    for (;;) {
+        ssize_t got = read(fd, buf, n);
+        if (got >= 0) return got;
+        if (errno != EINTR) PANIC("Could not read input: %m");
+    }
+}
+
+// The rest of stdin (starting with what the other readers have buffered) or
+// a whole file.  Files are read into a buffer of exactly their size.
+Value native_read_all(EvalContext *ctx, size_t argc, Value *argv) {
+    LineReader *r = argc == 0 ? stdin_reader() : NULL;
+    int fd = r ? r->fd : open_input("read_all", argc, argv);
+    size_t buffered = r ? r->count - r->start : 0;
+    size_t size = buffered + READER_BLOCK_SIZE;
+    struct stat st;
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && at >= 0 && st.st_size >= at) {
+        size = buffered + st.st_size - at;
+    }
+
+    StringBuf *buf = malloc(sizeof(StringBuf) + size + 1);
+    assert(buf != NULL && "Buy more RAM lol");
+    size_t count = buffered;
+    if (r) {
+        memcpy(buf->data, r->items + r->start, buffered);
+        r->start = r->count;
+    }
+    if (!r || !r->eof) {
+        for (;;) {
+            if (count == size) {
+                // full (maybe exactly at the end): check before growing
+                char probe[4096];
+                ssize_t n = read_input(fd, probe, sizeof(probe));
+                if (n == 0) break;
+                size = size * 2 + n;
+                buf = realloc(buf, sizeof(StringBuf) + size + 1);
+                assert(buf != NULL && "Buy more RAM lol");
+                memcpy(buf->data + count, probe, n);
+                count += n;
+                continue;
+            }
+            ssize_t n = read_input(fd, buf->data + count, size - count);
+            if (n == 0) break;
+            count += n;
+        }
+        if (r) r->eof = true;
+        else close(fd);
+    }
+    buf->data[count] = '\0';
+    buf->used = count;
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = {
+            .items = buf->data,
+            .count = count,
+            .capacity = size + 1,
+        },
+    };
+}
+
+Value native_append(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc >= 2);
+    if (argv[0].kind != VK_ARRAY) PANIC("Argument one of append must be an array");
+    ValueArray va = argv[0].value.array;
+    va.capacity = va.count + argc - 1;
+    Value *new_items = malloc(sizeof(Value) * va.capacity);
+    va.items = va.count == 0 ? new_items : memcpy(new_items, va.items, sizeof(Value) * va.count);
+    memcpy(va.items + va.count, argv + 1, sizeof(Value) * (argc - 1));
+    va.count += argc - 1;
+    return (Value) {
+        .kind = VK_ARRAY,
+        .value.array = va
+    };
+}
+
+Value native_length(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    int n;
+    switch (argv[0].kind) {
+        case VK_STRING:
+            n = argv[0].value.string.count;
+            break;
+        case VK_ARRAY:
+            n = argv[0].value.array.count;
+            break;
+        case VK_MAP:
+            n = argv[0].value.map->count;
+            break;
+        case VK_UNIT:
+        case VK_INT:
+        case VK_CHAR:
+        case VK_BOOL:
+        case VK_FUNCTION:
+        case VK_NATIVE_FUNCTION:
+        case VK_READER:
+        case __VK_LENGTH:
+            PANIC("Cannot get length of type %s.", vk_names[argv[0].kind]);
+            break;
+    }
+    return (Value) {
+        .kind = VK_INT,
+        .value.integer = n
+    };
+}
+
+// A string argument that is searched for.  Characters are accepted too, and
+// are stored in `buf`.
+String needle_arg(const char *fn_name, Value *v, char *buf) {
+    if (v->kind == VK_CHAR) {
+        *buf = v->value.character;
+        return (String) { .items = buf, .count = 1, .capacity = -1 };
+    }
+    if (v->kind != VK_STRING) PANIC("%s expected a STRING or CHAR, found %s.", fn_name, vk_names[v->kind]);
+    return v->value.string;
+}
+
+// returns the offset of `needle` in `hay`, or -1
+ssize_t find_string(String hay, String needle) {
+    if (needle.count == 0) return 0;
+    const char *at;
+    if (needle.count == 1) at = memchr(hay.items, needle.items[0], hay.count);
+    else at = memmem(hay.items, hay.count, needle.items, needle.count);
+    return at ? at - hay.items : -1;
+}
+
+// (substr s start) / (substr s start len): shares the characters of s
+Value native_substr(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_STRING) PANIC("Argument one of substr must be a string, found %s.", vk_names[argv[0].kind]);
+    String str = argv[0].value.string;
+    for (size_t i = 1; i < argc; ++i) {
+        if (argv[i].kind != VK_INT) PANIC("Arguments of substr after the string must be INT, found %s.", vk_names[argv[i].kind]);
+    }
+    int start = argv[1].value.integer;
+    if (start < 0 || start > str.count) PANIC("Index %d out of bounds for length %ld", start, str.count);
+    int len = argc > 2 ? argv[2].value.integer : (int)(str.count - start);
+    if (len < 0 || (size_t) len > str.count - start) PANIC("Length %d out of bounds for substring at %d of length %ld", len, start, str.count);
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = {
+            .items = str.items + start,
+            .count = len,
+            .capacity = -1,
+        },
+    };
+}
+
+// (find s needle) / (find s needle from): index of needle in s, or -1
+Value native_find(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_STRING) PANIC("Argument one of find must be a string, found %s.", vk_names[argv[0].kind]);
+    String hay = argv[0].value.string;
+    char c;
+    String needle = needle_arg("find", &argv[1], &c);
+    int from = 0;
+    if (argc > 2) {
+        if (argv[2].kind != VK_INT) PANIC("Argument three of find must be an INT, found %s.", vk_names[argv[2].kind]);
+        from = argv[2].value.integer;
+        if (from < 0 || from > hay.count) PANIC("Index %d out of bounds for length %ld", from, hay.count);
+    }
+    hay.items += from;
+    hay.count -= from;
+    ssize_t at = find_string(hay, needle);
+    return (Value) {
+        .kind = VK_INT,
+        .value.integer = at < 0 ? -1 : at + from,
+    };
+}
+
+Value native_starts_with(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_STRING) PANIC("Argument one of starts_with must be a string, found %s.", vk_names[argv[0].kind]);
+    String str = argv[0].value.string;
+    char c;
+    String prefix = needle_arg("starts_with", &argv[1], &c);
+    return (Value) {
+        .kind = VK_BOOL,
+        .value.integer = prefix.count <= str.count && !memcmp(str.items, prefix.items, prefix.count),
+    };
+}
+
+// (split s sep): array of the pieces of s between each sep, sharing the characters of s
+Value native_split(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_STRING) PANIC("Argument one of split must be a string, found %s.", vk_names[argv[0].kind]);
+    String rest = argv[0].value.string;
+    char c;
+    String sep = needle_arg("split", &argv[1], &c);
+    if (sep.count == 0) PANIC("Separator passed to split must not be empty.");
+
+    ValueArray out = { 0 };
+    for (;;) {
+        ssize_t at = find_string(rest, sep);
+        size_t len = at < 0 ? rest.count : (size_t)at;
+        Value field = {
+            .kind = VK_STRING,
+            .value.string = {
+                .items = rest.items,
+                .count = len,
+                .capacity = -1,
+            },
+        };
+        da_append(&out, field);
+        if (at < 0) break;
+        rest.items += len + sep.count;
+        rest.count -= len + sep.count;
+    }
+    return (Value) {
+        .kind = VK_ARRAY,
+        .value.array = out,
+    };
+}
+
+// (join array sep): the values of array formatted one after another, separated by sep
+Value native_join(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_ARRAY) PANIC("Argument one of join must be an array, found %s.", vk_names[argv[0].kind]);
+    ValueArray array = argv[0].value.array;
+    char c;
+    String sep = needle_arg("join", &argv[1], &c);
+
+    size_t total = array.count ? sep.count * (array.count - 1) : 0;
+    for (size_t i = 0; i < array.count; ++i) {
+        if (array.items[i].kind == VK_STRING) total += array.items[i].value.string.count;
+    }
+    String out = { 0 };
+    reserve_string(&out, total);
+    Sink sink = { .string = &out };
+    for (size_t i = 0; i < array.count; ++i) {
+        if (i != 0) sink_write(sink, sep.items, sep.count);
+        format_value(sink, array.items[i]);
+    }
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = out,
+    };
+}
+
+// (replace s old new): s with every occurrence of old replaced by new
+Value native_replace(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_STRING) PANIC("Argument one of replace must be a string, found %s.", vk_names[argv[0].kind]);
+    String rest = argv[0].value.string;
+    char c1, c2;
+    String from = needle_arg("replace", &argv[1], &c1);
+    String to = needle_arg("replace", &argv[2], &c2);
+    if (from.count == 0) PANIC("String to replace must not be empty.");
+
+    ssize_t at = find_string(rest, from);
+    if (at < 0) return argv[0];
+
+    String out = { 0 };
+    reserve_string(&out, rest.count);
+    do {
+        append_string(&out, rest.items, at);
+        append_string(&out, to.items, to.count);
+        rest.items += at + from.count;
+        rest.count -= at + from.count;
+    } while ((at = find_string(rest, from)) >= 0);
+    append_string(&out, rest.items, rest.count);
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = out,
+    };
+}
+
+// Sorting: pattern-defeating quicksort (Orson Peters, 2021) over Values, with
+// the ordering given either by the natural order of values or by a
+// comparator written in the language, plus an LSD radix sort for arrays that
+// only hold ints.  Unlike the reference pdqsort, the partition loops are
+// bounds checked, so a comparator that isn't a strict weak ordering gives a
+// badly sorted array instead of reading out of bounds.
+typedef struct {
+    EvalContext *ctx;
+    Value comparator; // UNIT for the natural order
+} SortOrder;
+
+// natural order: by kind first, then by value
+bool value_less(Value a, Value b) {
+    if (a.kind != b.kind) return a.kind < b.kind;
+    if (a.kind == VK_BOOL) return !a.value.integer && b.value.integer;
+    return compare_values(a, b) == ORD_LESS;
+}
+
+static inline bool sort_less(SortOrder *order, const Value *a, const Value *b) {
+    if (order->comparator.kind == VK_UNIT) return value_less(*a, *b);
+    Value args[2] = { *a, *b };
+    return value_to_bool(apply_fn(order->ctx, "comparator", order->comparator, 2, args));
+}
+
+static inline void swap_values(Value *a, Value *b) {
+    Value tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+#define PDQ_INSERTION_SORT_THRESHOLD 24
+#define PDQ_NINTHER_THRESHOLD 128
+#define PDQ_PARTIAL_INSERTION_SORT_LIMIT 8
+
+void pdq_insertion_sort(SortOrder *order, Value *begin, Value *end) {
+    if (begin == end) return;
+    for (Value *cur = begin + 1; cur != end; ++cur) {
+        Value *sift = cur;
+        Value *sift_1 = cur - 1;
+        if (sort_less(order, sift, sift_1)) {
+            Value tmp = *sift;
+            do {
+                *sift-- = *sift_1;
+            } while (sift != begin && sort_less(order, &tmp, --sift_1));
+            *sift = tmp;
+        }
+    }
+}
+
+// like insertion sort, but gives up (returning false) after moving more
+// than PDQ_PARTIAL_INSERTION_SORT_LIMIT elements
+bool pdq_partial_insertion_sort(SortOrder *order, Value *begin, Value *end) {
+    if (begin == end) return true;
+    size_t limit = 0;
+    for (Value *cur = begin + 1; cur != end; ++cur) {
+        Value *sift = cur;
+        Value *sift_1 = cur - 1;
+        if (sort_less(order, sift, sift_1)) {
+            Value tmp = *sift;
+            do {
+                *sift-- = *sift_1;
+            } while (sift != begin && sort_less(order, &tmp, --sift_1));
+            *sift = tmp;
+            limit += cur - sift;
+        }
+        if (limit > PDQ_PARTIAL_INSERTION_SORT_LIMIT) return false;
+    }
+    return true;
+}
+
+static inline void pdq_sort2(SortOrder *order, Value *a, Value *b) {
+    if (sort_less(order, b, a)) swap_values(a, b);
+}
+
+static inline void pdq_sort3(SortOrder *order, Value *a, Value *b, Value *c) {
+    pdq_sort2(order, a, b);
+    pdq_sort2(order, b, c);
+    pdq_sort2(order, a, b);
+}
+
+void pdq_sift_down(SortOrder *order, Value *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t child = 2*i + 1;
+        if (child >= n) return;
+        if (child + 1 < n && sort_less(order, &heap[child], &heap[child + 1])) child += 1;
+        if (!sort_less(order, &heap[i], &heap[child])) return;
+        swap_values(&heap[i], &heap[child]);
+        i = child;
+    }
+}
+
+void pdq_heap_sort(SortOrder *order, Value *begin, Value *end) {
+    size_t n = end - begin;
+    for (size_t i = n / 2; i-- > 0;) pdq_sift_down(order, begin, n, i);
+    while (n > 1) {
+        swap_values(&begin[0], &begin[--n]);
+        pdq_sift_down(order, begin, n, 0);
+    }
+}
+
+// Partitions [begin, end) around the pivot *begin, putting elements equal to
+// the pivot on the right.  Returns the pivot's final position.
+Value *pdq_partition_right(SortOrder *order, Value *begin, Value *end, bool *already_partitioned) {
+    Value pivot = *begin;
+    Value *first = begin;
+    Value *last = end;
+
+    // find the first element >= pivot and the last element < pivot
+    while (++first < end && sort_less(order, first, &pivot));
+    if (first - 1 == begin) {
+        while (first < last && !sort_less(order, --last, &pivot));
+    } else {
+        while (--last > begin && !sort_less(order, last, &pivot));
+    }
+
+    *already_partitioned = first >= last;
+    while (first < last) {
+        swap_values(first, last);
+        while (++first < end && sort_less(order, first, &pivot));
+        while (--last > begin && !sort_less(order, last, &pivot));
+    }
+
+    Value *pivot_pos = first - 1;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+// Like pdq_partition_right, but puts elements equal to the pivot on the left.
+// Used when the pivot equals the element before the range, in which case
+// the whole left side is equal and needs no further sorting.
+Value *pdq_partition_left(SortOrder *order, Value *begin, Value *end) {
+    Value pivot = *begin;
+    Value *first = begin;
+    Value *last = end;
+
+    while (--last > begin && sort_less(order, &pivot, last));
+    if (last + 1 == end) {
+        while (first < last && !sort_less(order, &pivot, ++first));
+    } else {
+        while (++first < end && !sort_less(order, &pivot, first));
+    }
+
+    while (first < last) {
+        swap_values(first, last);
+        while (--last > begin && sort_less(order, &pivot, last));
+        while (++first < end && !sort_less(order, &pivot, first));
+    }
+
+    Value *pivot_pos = last;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+void pdq_sort_loop(SortOrder *order, Value *begin, Value *end, int bad_allowed, bool leftmost) {
+    for (;;) {
+        size_t size = end - begin;
+        if (size < PDQ_INSERTION_SORT_THRESHOLD) {
+            pdq_insertion_sort(order, begin, end);
+            return;
+        }
+
+        // pivot: median of 3, or pseudo-median of 9 for large ranges
+        size_t s2 = size / 2;
+        if (size > PDQ_NINTHER_THRESHOLD) {
+            pdq_sort3(order, begin, begin + s2, end - 1);
+            pdq_sort3(order, begin + 1, begin + (s2 - 1), end - 2);
+            pdq_sort3(order, begin + 2, begin + (s2 + 1), end - 3);
+            pdq_sort3(order, begin + (s2 - 1), begin + s2, begin + (s2 + 1));
+            swap_values(begin, begin + s2);
+        } else {
+            pdq_sort3(order, begin + s2, begin, end - 1);
+        }
+
+        // the previous pivot is to our left and equal to this one: everything
+        // equal to the pivot is in place already
+        if (!leftmost && !sort_less(order, begin - 1, begin)) {
+            begin = pdq_partition_left(order, begin, end) + 1;
+            continue;
+        }
+
+        bool already_partitioned;
+        Value *pivot_pos = pdq_partition_right(order, begin, end, &already_partitioned);
+
+        size_t l_size = pivot_pos - begin;
+        size_t r_size = end - (pivot_pos + 1);
+        bool highly_unbalanced = l_size < size / 8 || r_size < size / 8;
+
+        if (highly_unbalanced) {
+            // too many bad pivots: fall back to heap sort for guaranteed O(n log n)
+            if (--bad_allowed == 0) {
+                pdq_heap_sort(order, begin, end);
+                return;
+            }
+
+            // break up patterns that make the pivot selection go wrong
+            if (l_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+                swap_values(begin, begin + l_size / 4);
+                swap_values(pivot_pos - 1, pivot_pos - l_size / 4);
+                if (l_size > PDQ_NINTHER_THRESHOLD) {
+                    swap_values(begin + 1, begin + (l_size / 4 + 1));
+                    swap_values(begin + 2, begin + (l_size / 4 + 2));
+                    swap_values(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+                    swap_values(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+                }
+            }
+            if (r_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+                swap_values(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+                swap_values(end - 1, end - r_size / 4);
+                if (r_size > PDQ_NINTHER_THRESHOLD) {
+                    swap_values(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+                    swap_values(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+                    swap_values(end - 2, end - (1 + r_size / 4));
+                    swap_values(end - 3, end - (2 + r_size / 4));
+                }
+            }
+        } else if (already_partitioned
+                   && pdq_partial_insertion_sort(order, begin, pivot_pos)
+                   && pdq_partial_insertion_sort(order, pivot_pos + 1, end)) {
+            // the input was (nearly) sorted already
+            return;
+        }
+
+        // recurse into the left part, loop on the right one
+        pdq_sort_loop(order, begin, pivot_pos, bad_allowed, leftmost);
+        begin = pivot_pos + 1;
+        leftmost = false;
+    }
+}
+
+void pdq_sort(SortOrder *order, Value *items, size_t n) {
+    int log2 = 0;
+    while ((n >> log2) > 1) ++log2;
+    pdq_sort_loop(order, items, items + n, log2 + 1, true);
+}
+
+// LSD radix sort on the bytes of the ints (with the sign bit flipped so that
+// negative numbers come first), skipping bytes that are the same everywhere.
+void radix_sort_ints(Value *items, size_t n) {
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    uint32_t *tmp = malloc(n * sizeof(uint32_t));
+    assert(keys != NULL && tmp != NULL && "Buy more RAM lol");
+    size_t counts[4][256] = { 0 };
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t k = (uint32_t)items[i].value.integer ^ 0x80000000u;
+        keys[i] = k;
+        for (int b = 0; b < 4; ++b) counts[b][(k >> (8*b)) & 0xff] += 1;
+    }
+    for (int b = 0; b < 4; ++b) {
+        if (counts[b][(keys[0] >> (8*b)) & 0xff] == n) continue;
+        size_t offset = 0;
+        for (int d = 0; d < 256; ++d) {
+            size_t c = counts[b][d];
+            counts[b][d] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            tmp[counts[b][(keys[i] >> (8*b)) & 0xff]++] = keys[i];
+        }
+        uint32_t *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        items[i].value.integer = (int)(keys[i] ^ 0x80000000u);
+    }
+    free(keys);
+    free(tmp);
+}
+
+#define RADIX_SORT_THRESHOLD 64
+
+// (sort array) / (sort array less): a sorted copy of array.  `less` is
+// called with two elements and returns whether the first goes before the second.
+Value native_sort(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argv[0].kind != VK_ARRAY) PANIC("Argument one of sort must be an array, found %s.", vk_names[argv[0].kind]);
+    ValueArray array = argv[0].value.array;
+    SortOrder order = { .ctx = ctx };
+    if (argc > 1) {
+        order.comparator = argv[1];
+        if (order.comparator.kind != VK_FUNCTION && order.comparator.kind != VK_NATIVE_FUNCTION) PANIC("Comparator must be a function");
+    }
+
+    ValueArray out = { 0 };
+    out.items = malloc(sizeof(Value) * (out.capacity = array.count));
+    out.count = array.count;
+    if (array.count) memcpy(out.items, array.items, sizeof(Value) * array.count);
+
+    bool all_ints = order.comparator.kind == VK_UNIT && out.count >= RADIX_SORT_THRESHOLD;
+    for (size_t i = 0; all_ints && i < out.count; ++i) {
+        all_ints = out.items[i].kind == VK_INT;
+    }
+    if (all_ints) {
+        radix_sort_ints(out.items, out.count);
+    } else {
+        pdq_sort(&order, out.items, out.count);
+    }
+
+    return (Value) {
+        .kind = VK_ARRAY,
+        .value.array = out,
+    };
+}
+
+// (dict k1 v1 k2 v2 ...)
+Value native_dict(EvalContext *ctx, size_t argc, Value *argv) {
+    if (argc % 2 != 0) PANIC("dict expects pairs of keys and values, got %ld arguments.", argc);
+    Map *m = new_map(argc / 2);
+    for (size_t i = 0; i < argc; i += 2) {
+        map_put(m, argv[i], argv[i + 1]);
+    }
+    return (Value) {
+        .kind = VK_MAP,
+        .value.map = m,
+    };
+}
+
+Map *map_arg(const char *fn_name, Value v) {
+    if (v.kind != VK_MAP) PANIC("Argument one of %s must be a map, found %s.", fn_name, vk_names[v.kind]);
+    return v.value.map;
+}
+
+// (get m k) / (get m k default): () or default when k isn't in m
+Value native_get(EvalContext *ctx, size_t argc, Value *argv) {
+    Value *v = map_get(map_arg("get", argv[0]), argv[1]);
+    if (v) return *v;
+    if (argc > 2) return argv[2];
+    return (Value) { 0 };
+}
+
+// (put m k v): maps are shared rather than copied, so this changes m (and returns it)
+Value native_put(EvalContext *ctx, size_t argc, Value *argv) {
+    map_put(map_arg("put", argv[0]), argv[1], argv[2]);
+    return argv[0];
+}
+
+Value native_has(EvalContext *ctx, size_t argc, Value *argv) {
+    return (Value) {
+        .kind = VK_BOOL,
+        .value.integer = map_get(map_arg("has", argv[0]), argv[1]) != NULL,
+    };
+}
+
+Value native_keys(EvalContext *ctx, size_t argc, Value *argv) {
+    Map *m = map_arg("keys", argv[0]);
+    ValueArray out = { 0 };
+    out.items = malloc(sizeof(Value) * (out.capacity = m->count));
+    for (size_t i = 0; i < m->capacity; ++i) {
+        if (m->ctrl[i] >= 0) out.items[out.count++] = m->entries[i].key;
+    }
+    return (Value) {
+        .kind = VK_ARRAY,
+        .value.array = out,
+    };
+}
+
+// (remove m k): whether k was in m
+Value native_remove(EvalContext *ctx, size_t argc, Value *argv) {
+    return (Value) {
+        .kind = VK_BOOL,
+        .value.integer = map_remove(map_arg("remove", argv[0]), argv[1]),
+    };
+}
+
+Value native_int(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    Value v = argv[0];
+    if (!coerce(&v, VK_INT)) PANIC("Cannot cast type %s to INT.", vk_names[v.kind]);
+    return v;
+}
+
+Value native_string(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    return (Value) {
+        .kind = VK_STRING,
+        .value.string = value_to_string(argv[0])
+    };
+}
+
+Value native_char(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    Value v = argv[0];
+    if (!coerce(&v, VK_CHAR)) PANIC("Cannot cast type %s to CHAR.", vk_names[v.kind]);
+    return v;
+}
+
+Value native_bool(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1);
+    Value v = argv[0];
+    if (!coerce(&v, VK_BOOL)) PANIC("Cannot cast type %s to BOOL.", vk_names[v.kind]);
+    return v;
+}
+
+Value native_map(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 2);
+    Value varray = argv[0];
+    if (varray.kind != VK_ARRAY) PANIC("Argument one of append must be an array");
+    ValueArray array = varray.value.array;
+    Value mapper = argv[1];
+    if (mapper.kind != VK_FUNCTION && mapper.kind != VK_NATIVE_FUNCTION) PANIC("Mapper must be a function");
+    ValueArray out = { 0 };
+    out.items = malloc(sizeof(Value) * (out.capacity = array.count));
+
+    for (size_t i = 0; i < array.count; ++i) {
+        out.items[i] = apply_fn(ctx, "mapper", mapper, 1, &array.items[i]);
+    }
+    out.count = array.count;
 
-                case TK_DOT: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count != 2) {
-                        PANIC("Expected two arguments, got %ld", fn.args.count);
-                    }
-                    Value arg0 = eval(fn.args.items[0], ctx);
-                    Value arg1 = eval(fn.args.items[1], ctx);
-                    switch (arg0.kind) {
-                        case VK_UNIT:
-                        case VK_INT:
-                        case VK_BOOL:
-                        case VK_FUNCTION:
-                        case VK_CHAR:
-                        case VK_NATIVE_FUNCTION:
-                            PANIC("Cannot index into %s", vk_names[arg0.kind]);
-                        case VK_STRING: {
-                            String string = arg0.value.string;
-                            if (arg1.kind != VK_INT) PANIC("Cannot index into %s with type %s", vk_names[arg0.kind], vk_names[arg1.kind]);
-                            int n = arg1.value.integer;
-                            if (n < 0 || n > string.count) PANIC("Index %d out of bounds for length %ld", n, string.count);
-                            return (Value) {
-                                .kind = VK_CHAR,
-                                .value = {
-                                    .character = string.items[n],
-                                },
-                            };
-                        } break;
-                        case VK_ARRAY: {
-                            ValueArray array = arg0.value.array;
-                            if (arg1.kind != VK_INT) PANIC("Cannot index into %s with type %s", vk_names[arg0.kind], vk_names[arg1.kind]);
-                            int n = arg1.value.integer;
-                            if (n < 0 || n > array.count) PANIC("Index %d out of bounds for length %ld", n, array.count);
-                            return array.items[n];
-                        } break;
-                        case __VK_LENGTH:
-                            break;
-                    }
-                } break;
-                case TK_AT: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    Value ret = {
-                        .kind = VK_ARRAY,
-                        .value = {
-                            .array = { 0 },
-                        },
-                    };
-                    for (size_t i = 0; i < fn.args.count; ++i) {
-                        da_append(&ret.value.array, eval(fn.args.items[i], ctx));
-                    }
-                    return ret;
-                } break;
-                case TK_EVAL: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count < 1) PANIC("Eval operation must have at least on expression");
-                    Value ret = { 0 };
-                    for (size_t i = 0; i < fn.args.count; ++i) {
-                        ret = eval(fn.args.items[i], ctx);
-                    }
-                    return ret;
-                } break;
-                case TK_PLUS: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count < 1) PANIC("Add operation must contain at least one value.");
-                    Value out = { 0 };
-                    for (size_t i = 0; i < fn.args.count; ++i) {
-                        add_value(&out, eval(fn.args.items[i], ctx));
-                    }
-                    return out;
-                } break;
-                case TK_MINUS: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count < 2) PANIC("Subtract operation must contain at least two values.");
-                    Value out = eval(fn.args.items[0], ctx);
-                    for (size_t i = 1; i < fn.args.count; ++i) {
-                        sub_value(&out, eval(fn.args.items[i], ctx));
-                    }
-                    return out;
-                } break;
-                case TK_STAR: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count < 1) PANIC("Multiply operation must contain at least one value.");
-                    Value out = {
-                        .kind = VK_INT,
-                        .value = {
-                            .integer = 1,
-                        },
-                    };
-                    for (size_t i = 0; i < fn.args.count; ++i) {
-                        mult_value(&out, eval(fn.args.items[i], ctx));
-                    }
-                    return out;
-                } break;
-                case TK_SLASH: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    if (fn.args.count < 2) PANIC("Subtract operation must contain at least two values.");
-                    Value out = eval(fn.args.items[0], ctx);
-                    for (size_t i = 1; i < fn.args.count; ++i) {
-                        div_value(&out, eval(fn.args.items[i], ctx));
-                    }
-                    return out;
-                } break;
-                case TK_IDENT: {
-                    FunctionCallValue fn = ast.value.fn_call;
-                    const char *name = fn.op.value.ident;
-                    Value *var = get_var(ctx, name);
-                    if (var == NULL) {
-                        PANIC("Unknown function '%s'", name);
-                    }
-                    if (var->kind != VK_FUNCTION && var->kind != VK_NATIVE_FUNCTION) {
-                        PANIC("Variable '%s' is not a function.", name);
-                    }
-                    Value args[fn.args.count];
-                    for (size_t i = 0; i < fn.args.count; ++i) {
-                        args[i] = eval(fn.args.items[i], ctx);
-                    }
-                    return apply_fn(ctx, name, *var, fn.args.count, args);
-                } break;
-            }
-        } break;
-        case EK_FOR: {
-            ForValue f = ast.value.for_;
-            eval(*f.init, ctx);
-            for (;;) {
-                // if condition is (), then we pretend it's `true`, like C does.
-                if (f.cond->kind != EK_UNIT) {
-                    Value cond = eval(*f.cond, ctx);
-                    if (!value_to_bool(cond)) break;
-                }
-                eval(*f.body, ctx);
-                eval(*f.post, ctx);
-            }
+    return (Value) {
+        .kind = VK_ARRAY,
+        .value.array = out,
+    };
+}
 
-            return (Value) { 0 };
-        } break;
-        case EK_WHILE: {
-            WhileValue w = ast.value.while_;
-            for (;;) {
-                Value cond = eval(*w.cond, ctx);
-                if (!value_to_bool(cond)) break;
-                eval(*w.body, ctx);
-            }
+// Script cache: the optimized tree of a script is saved to
+// $LISP_CACHE_DIR (or ~/.cache/lisp) under the hash of its source, and the
+// next run maps it back in instead of parsing and optimizing again.  The file
+// is one block laid out like the tree in memory, with pointers stored as
+// offsets into the block.  Loading maps it privately and turns the offsets
+// listed in its relocation table back into pointers, and the identifiers
+// into interned symbols, so the nodes are used right where they are.
+#define IMAGE_MAGIC "LISPAST1"
 
-            return (Value) { 0 };
-        } break;
-        case EK_IF: {
-            IfValue if_ = ast.value.if_;
-            Value cond = eval(*if_.cond, ctx);
-            if (value_to_bool(cond)) {
-                return eval(*if_.true_branch, ctx);
-            }
+typedef struct {
+    char magic[8];
+    uint64_t build; // of the interpreter that wrote it, see image_build
+    uint64_t checksum; // of everything after the header
+    uint64_t source_hash;
+    uint64_t source_size;
+    size_t size;
+    size_t root; // AST
+    size_t relocs; // offsets of pointers (stored as offsets) to relocate
+    size_t reloc_count;
+    size_t symbol_relocs; // offsets of identifiers (stored as symbol indices)
+    size_t symbol_reloc_count;
+    size_t symbols; // offsets of their names
+    size_t symbol_count;
+    // only in snapshots, see snapshot_save
+    size_t vars; // VariableMapEntry
+    size_t var_count;
+    size_t natives; // offsets of VK_NATIVE_FUNCTION values to look up again
+    size_t native_count;
+    size_t maps; // offsets of maps, whose tables have to be on the heap
+    size_t map_count;
+} ImageHeader;
 
-            if (if_.false_branch) {
-                return eval(*if_.false_branch, ctx);
-            }
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} OffsetList;
 
-            return (Value) { 0 };
-        } break;
-        case EK_FUNCTION_DEF: {
-            return (Value) {
-                .kind = VK_FUNCTION,
-                .value.fn = ast.value.fn_def,
-            };
-        } break;
-        case EK_DECLARE_VAR: {
-            DeclareAssign dec = ast.value.declare_assign;
-            Value *var = add_var(ctx->parent, dec.name);
-            if (dec.value) {
-                *var = eval(*dec.value, ctx);
+// what was already written for a pointer, so that shared things stay shared
+typedef struct {
+    const void *ptr;
+    size_t at;
+    size_t count; // of the items written, for arrays
+} ImageSeen;
+
+typedef struct {
+    ImageSeen *items; // open addressing, NULL ptr is free
+    size_t count;
+    size_t capacity;
+} ImageSeenTable;
+
+typedef struct {
+    char *items;
+    size_t count;
+    size_t capacity;
+    OffsetList relocs;
+    OffsetList symbol_relocs;
+    ParamList symbols;
+    ImageSeenTable seen;
+    OffsetList natives; // see ImageHeader
+    OffsetList maps;
+} ImageWriter;
+
+bool hash_source(const char *path, uint64_t *hash, size_t *size);
+
+// The layout and meaning of the tree change with the interpreter, so images
+// are only used by the same binary that wrote them.  Where it can't be read,
+// the time it was built has to do.
+uint64_t image_build(void) {
+    static uint64_t build = 0;
+    if (build) return build;
+    uint64_t hash;
+    size_t size;
+    if (hash_source("/proc/self/exe", &hash, &size)) {
+        build = hash_mix(hash ^ size);
+    } else {
+        const char *time = __DATE__ " " __TIME__;
+        build = hash_bytes(time, strlen(time));
+    }
+    build = hash_mix(build ^ sizeof(AST));
+    return build;
+}
+
+// zeroed and aligned space for `size` bytes
+size_t image_alloc(ImageWriter *w, size_t size) {
+    size_t at = (w->count + 7) & ~(size_t) 7;
+    size_t end = at + size;
+    if (end > w->capacity) {
+        w->capacity = w->capacity ? w->capacity : 4096;
+        while (end > w->capacity) w->capacity *= 2;
+        w->items = realloc(w->items, w->capacity);
+        assert(w->items != NULL && "Buy more RAM lol");
+    }
+    memset(w->items + w->count, 0, end - w->count);
+    w->count = end;
+    return at;
+}
+
+size_t image_bytes(ImageWriter *w, const void *data, size_t size) {
+    size_t at = image_alloc(w, size + 1);
+    memcpy(w->items + at, data, size);
+    return at;
+}
+
+// points the pointer at `field` to offset `target`
+void image_pointer(ImageWriter *w, size_t field, size_t target) {
+    memcpy(w->items + field, &target, sizeof(target));
+    da_append(&w->relocs, field);
+}
+
+void image_symbol(ImageWriter *w, size_t field, const char *ident) {
+    size_t index = 0;
+    while (index < w->symbols.count && w->symbols.items[index] != ident) ++index;
+    if (index == w->symbols.count) da_append(&w->symbols, ident);
+    memcpy(w->items + field, &index, sizeof(index));
+    da_append(&w->symbol_relocs, field);
+}
+
+ImageSeen *image_find_seen(ImageWriter *w, const void *ptr) {
+    if (w->seen.capacity == 0) return NULL;
+    size_t mask = w->seen.capacity - 1;
+    for (size_t i = hash_mix((uintptr_t) ptr) & mask;; i = (i + 1) & mask) {
+        ImageSeen *s = &w->seen.items[i];
+        if (s->ptr == ptr) return s;
+        if (s->ptr == NULL) return NULL;
+    }
+}
+
+void image_add_seen(ImageWriter *w, const void *ptr, size_t at, size_t count) {
+    if ((w->seen.count + 1) * 2 > w->seen.capacity) {
+        ImageSeenTable old = w->seen;
+        w->seen.capacity = old.capacity ? old.capacity * 2 : 64;
+        w->seen.items = calloc(w->seen.capacity, sizeof(ImageSeen));
+        assert(w->seen.items != NULL && "Buy more RAM lol");
+        w->seen.count = 0;
+        for (size_t i = 0; i < old.capacity; ++i) {
+            if (old.items[i].ptr) image_add_seen(w, old.items[i].ptr, old.items[i].at, old.items[i].count);
+        }
+        free(old.items);
+    }
+    size_t mask = w->seen.capacity - 1;
+    size_t i = hash_mix((uintptr_t) ptr) & mask;
+    while (w->seen.items[i].ptr != NULL && w->seen.items[i].ptr != ptr) i = (i + 1) & mask;
+    if (w->seen.items[i].ptr == NULL) w->seen.count++;
+    w->seen.items[i] = (ImageSeen) { .ptr = ptr, .at = at, .count = count };
+}
+
+void image_ast(ImageWriter *w, size_t at, AST *ast);
+
+// a copy of the node `ast` points to, for the pointer at `field`
+void image_child(ImageWriter *w, size_t field, AST *ast) {
+    if (ast == NULL) return;
+    size_t child = image_alloc(w, sizeof(AST));
+    image_ast(w, child, ast);
+    image_pointer(w, field, child);
+}
+
+void image_list(ImageWriter *w, size_t field, ASTList list) {
+    if (list.count == 0) {
+        memset(w->items + field, 0, sizeof(ASTList));
+        return;
+    }
+    size_t items = image_alloc(w, list.count * sizeof(AST));
+    for (size_t i = 0; i < list.count; ++i) {
+        image_ast(w, items + i * sizeof(AST), &list.items[i]);
+    }
+    image_pointer(w, field + offsetof(ASTList, items), items);
+    memcpy(w->items + field + offsetof(ASTList, capacity), &list.count, sizeof(size_t));
+}
+
+// runtime state, starts out zeroed
+void image_state(ImageWriter *w, size_t field, size_t size) {
+    image_pointer(w, field, image_alloc(w, size));
+}
+
+#define AST_FIELD(at, member) ((at) + offsetof(AST, value.member))
+
+// a function definition at `at`, whose body is shared by every function value
+// made from it
+void image_fn_def(ImageWriter *w, size_t at, FunctionDefValue fn) {
+    memcpy(w->items + at, &fn, sizeof(fn));
+    memset(w->items + at + offsetof(FunctionDefValue, params), 0, sizeof(ParamList));
+    if (fn.params.count) {
+        size_t params = image_alloc(w, fn.params.count * sizeof(char *));
+        for (size_t i = 0; i < fn.params.count; ++i) {
+            image_symbol(w, params + i * sizeof(char *), fn.params.items[i]);
+        }
+        image_pointer(w, at + offsetof(FunctionDefValue, params.items), params);
+        memcpy(w->items + at + offsetof(FunctionDefValue, params.count), &fn.params.count, sizeof(size_t));
+        memcpy(w->items + at + offsetof(FunctionDefValue, params.capacity), &fn.params.count, sizeof(size_t));
+    }
+
+    ImageSeen *seen = image_find_seen(w, fn.body);
+    if (seen) {
+        image_pointer(w, at + offsetof(FunctionDefValue, body), seen->at);
+        image_pointer(w, at + offsetof(FunctionDefValue, jit), image_find_seen(w, fn.jit)->at);
+        return;
+    }
+    size_t body = image_alloc(w, sizeof(AST));
+    size_t jit = image_alloc(w, sizeof(JitSlot));
+    image_add_seen(w, fn.body, body, 1);
+    image_add_seen(w, fn.jit, jit, 1);
+    image_ast(w, body, fn.body);
+    image_pointer(w, at + offsetof(FunctionDefValue, body), body);
+    image_pointer(w, at + offsetof(FunctionDefValue, jit), jit);
+}
+
+void image_ast(ImageWriter *w, size_t at, AST *ast) {
+    memcpy(w->items + at, ast, sizeof(AST));
+    switch (ast->kind) {
+        case EK_ATOM:
+            if (ast->value.atom.kind == TK_IDENT) {
+                image_symbol(w, AST_FIELD(at, atom.value.ident), ast->value.atom.value.ident);
+            } else if (ast->value.atom.kind == TK_STRING) {
+                String s = ast->value.atom.value.string;
+                image_pointer(w, AST_FIELD(at, atom.value.string.items), image_bytes(w, s.items, s.count));
             }
-            return (Value) { 0 };
+            break;
+        case EK_UNIT:
+        case __EK_LENGTH:
+            break;
+        case EK_FUNCTION_CALL:
+        case EK_INT_ARITH:
+        case EK_INT_COMPARE:
+        case EK_STRING_CONCAT:
+        case EK_ARRAY_INDEX: {
+            FunctionCallValue fn = ast->value.fn_call;
+            if (fn.op.kind == TK_IDENT) image_symbol(w, AST_FIELD(at, fn_call.op.value.ident), fn.op.value.ident);
+            if (fn.cache) image_state(w, AST_FIELD(at, fn_call.cache), sizeof(CallCache));
+            image_list(w, AST_FIELD(at, fn_call.args), fn.args);
         } break;
-        case EK_ASSIGN_VAR: {
-            DeclareAssign ass = ast.value.declare_assign;
-            Value *var = get_var(ctx->parent, ass.name);
-            if (var == NULL) {
-                PANIC("Variable '%s' does not exist in ctx.", ass.name);
-            }
-            if (var->immutable) {
-                PANIC("Variable '%s' is immutable.", ass.name);
+        case EK_FUNCTION_DEF:
+            image_fn_def(w, AST_FIELD(at, fn_def), ast->value.fn_def);
+            break;
+        case EK_IF:
+            image_child(w, AST_FIELD(at, if_.cond), ast->value.if_.cond);
+            image_child(w, AST_FIELD(at, if_.true_branch), ast->value.if_.true_branch);
+            image_child(w, AST_FIELD(at, if_.false_branch), ast->value.if_.false_branch);
+            break;
+        case EK_DECLARE_VAR:
+        case EK_ASSIGN_VAR:
+            image_symbol(w, AST_FIELD(at, declare_assign.name), ast->value.declare_assign.name);
+            image_child(w, AST_FIELD(at, declare_assign.value), ast->value.declare_assign.value);
+            break;
+        case EK_WHILE:
+            image_child(w, AST_FIELD(at, while_.cond), ast->value.while_.cond);
+            image_child(w, AST_FIELD(at, while_.body), ast->value.while_.body);
+            image_list(w, AST_FIELD(at, while_.hoisted), ast->value.while_.hoisted);
+            image_state(w, AST_FIELD(at, while_.jit), sizeof(JitSlot));
+            break;
+        case EK_FOR: {
+            ForValue f = ast->value.for_;
+            image_child(w, AST_FIELD(at, for_.init), f.init);
+            image_child(w, AST_FIELD(at, for_.cond), f.cond);
+            image_child(w, AST_FIELD(at, for_.post), f.post);
+            image_child(w, AST_FIELD(at, for_.body), f.body);
+            image_list(w, AST_FIELD(at, for_.hoisted), f.hoisted);
+            image_state(w, AST_FIELD(at, for_.jit), sizeof(JitSlot));
+            if (f.counted) {
+                size_t counted = image_alloc(w, sizeof(CountedLoop));
+                memcpy(w->items + counted, f.counted, sizeof(CountedLoop));
+                image_symbol(w, counted + offsetof(CountedLoop, var), f.counted->var);
+                image_child(w, counted + offsetof(CountedLoop, bound), f.counted->bound);
+                image_pointer(w, AST_FIELD(at, for_.counted), counted);
             }
-            return *var = eval(*ass.value, ctx);
         } break;
     }
-    PANIC("Unknown expression kind: '%s'", ek_names[ast.kind]);
 }
 
-Value eval(AST ast, EvalContext *parent_ctx) {
-    EvalContext ctx = create_ctx(parent_ctx);
-    Value ret = eval_in_ctx(ast, &ctx);
-    free_ctx(ctx);
-    return ret;
+size_t image_offsets(ImageWriter *w, OffsetList list) {
+    size_t at = image_alloc(w, list.count * sizeof(size_t));
+    if (list.count) memcpy(w->items + at, list.items, list.count * sizeof(size_t));
+    return at;
+}
+
+// Where the cache for a source with this hash goes, or NULL when there's
+// nowhere to put it.
+char *image_path(uint64_t source_hash) {
+    char dir[PATH_MAX];
+    const char *env = getenv("LISP_CACHE_DIR");
+    if (env) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/lisp", env);
+    } else if ((env = getenv("HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/.cache", env);
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/lisp", env);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0755);
+
+    char *path = malloc(PATH_MAX + 32);
+    assert(path != NULL && "Buy more RAM lol");
+    snprintf(path, PATH_MAX + 32, "%s/%016lx%s.ast", dir, source_hash, opt_enabled ? "" : "-noopt");
+    return path;
+}
+
+// Adds the symbol names and relocation tables and fills in the header,
+// whose other fields are set by the caller.
+void image_finish(ImageWriter *w, const char *magic) {
+    size_t names[w->symbols.count + 1];
+    for (size_t i = 0; i < w->symbols.count; ++i) {
+        names[i] = image_bytes(w, w->symbols.items[i], strlen(w->symbols.items[i]));
+    }
+    size_t symbols = image_alloc(w, w->symbols.count * sizeof(size_t));
+    memcpy(w->items + symbols, names, w->symbols.count * sizeof(size_t));
+    // the tables aren't relocated themselves, so they go last
+    OffsetList relocs = w->relocs;
+    size_t relocs_at = image_offsets(w, relocs);
+    size_t symbol_relocs_at = image_offsets(w, w->symbol_relocs);
+
+    ImageHeader *h = (ImageHeader *) w->items;
+    memcpy(h->magic, magic, sizeof(h->magic));
+    h->build = image_build();
+    h->size = w->count;
+    h->relocs = relocs_at;
+    h->reloc_count = relocs.count;
+    h->symbol_relocs = symbol_relocs_at;
+    h->symbol_reloc_count = w->symbol_relocs.count;
+    h->symbols = symbols;
+    h->symbol_count = w->symbols.count;
+}
+
+// Written under another name first, so nobody maps half a file.
+bool image_write(ImageWriter *w, const char *path) {
+    ImageHeader *h = (ImageHeader *) w->items;
+    h->checksum = hash_bytes(w->items + sizeof(ImageHeader), w->count - sizeof(ImageHeader));
+    char tmp[PATH_MAX + 64];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    FILE *f = fopen(tmp, "wb");
+    bool ok = f != NULL;
+    if (ok) {
+        ok = fwrite(w->items, 1, w->count, f) == w->count;
+        ok = fclose(f) == 0 && ok && rename(tmp, path) == 0;
+        if (!ok) unlink(tmp);
+    }
+    free(w->items);
+    free(w->relocs.items);
+    free(w->symbol_relocs.items);
+    free(w->symbols.items);
+    free(w->seen.items);
+    return ok;
+}
+
+// Best effort: a cache that can't be written just means parsing next time.
+void image_save(AST *ast, const char *path, uint64_t source_hash, size_t source_size) {
+    ImageWriter w = { 0 };
+    image_alloc(&w, sizeof(ImageHeader));
+    size_t root = image_alloc(&w, sizeof(AST));
+    image_ast(&w, root, ast);
+    image_finish(&w, IMAGE_MAGIC);
+
+    ImageHeader *h = (ImageHeader *) w.items;
+    h->source_hash = source_hash;
+    h->source_size = source_size;
+    h->root = root;
+    image_write(&w, path);
+}
+
+// hash and size of a script, to find its cache by
+bool hash_source(const char *path, uint64_t *hash, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        *hash = hash_bytes("", 0);
+        return true;
+    }
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    *hash = hash_bytes(data, *size);
+    munmap(data, *size);
+    return true;
+}
+
+// The image at `path`, mapped privately but not relocated yet, or NULL if
+// there is none (from this build of the interpreter).
+ImageHeader *image_map(const char *path, const char *magic) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    ImageHeader *h = (ImageHeader *) base;
+    if (memcmp(h->magic, magic, sizeof(h->magic)) || h->build != image_build() || h->size != (size_t) st.st_size
+        || h->checksum != hash_bytes(base + sizeof(ImageHeader), h->size - sizeof(ImageHeader))) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+// whether `count` things of `size` bytes at `at` are inside the image (and
+// aligned, as everything image_alloc hands out is)
+bool image_fits(ImageHeader *h, size_t at, size_t count, size_t size) {
+    return at % 8 == 0 && at <= h->size && count <= (h->size - at) / size;
+}
+
+// Nothing in an image is trusted before it's checked against its bounds, so
+// a broken one is only ever not used.  Returns false for those.
+bool image_relocate(ImageHeader *h) {
+    char *base = (char *) h;
+    if (!image_fits(h, h->relocs, h->reloc_count, sizeof(size_t))
+        || !image_fits(h, h->symbols, h->symbol_count, sizeof(size_t))
+        || !image_fits(h, h->symbol_relocs, h->symbol_reloc_count, sizeof(size_t))) {
+        return false;
+    }
+    size_t *relocs = (size_t *) (base + h->relocs);
+    for (size_t i = 0; i < h->reloc_count; ++i) {
+        if (!image_fits(h, relocs[i], 1, sizeof(char *))) return false;
+        char **field = (char **) (base + relocs[i]);
+        if ((size_t) *field > h->size) return false;
+        *field = base + (size_t) *field;
+    }
+    const char **symbols = malloc(h->symbol_count * sizeof(char *) + 1);
+    assert(symbols != NULL && "Buy more RAM lol");
+    size_t *names = (size_t *) (base + h->symbols);
+    bool ok = true;
+    for (size_t i = 0; ok && i < h->symbol_count; ++i) {
+        ok = names[i] < h->size && memchr(base + names[i], 0, h->size - names[i]);
+        if (ok) symbols[i] = intern(base + names[i]);
+    }
+    size_t *symbol_relocs = (size_t *) (base + h->symbol_relocs);
+    for (size_t i = 0; ok && i < h->symbol_reloc_count; ++i) {
+        ok = image_fits(h, symbol_relocs[i], 1, sizeof(char *));
+        const char **field = (const char **) (base + symbol_relocs[i]);
+        ok = ok && (size_t) *field < h->symbol_count;
+        if (ok) *field = symbols[(size_t) *field];
+    }
+    free(symbols);
+    return ok;
+}
+
+// the cached tree, or NULL if there is none for this source
+AST *image_load(const char *path, uint64_t source_hash, size_t source_size) {
+    ImageHeader *h = image_map(path, IMAGE_MAGIC);
+    if (h == NULL) return NULL;
+    if (h->source_hash != source_hash || h->source_size != source_size
+        || !image_fits(h, h->root, 1, sizeof(AST)) || !image_relocate(h)) {
+        munmap(h, h->size);
+        return NULL;
+    }
+    return (AST *) ((char *) h + h->root);
+}
+
+// (memo f) / (memo f capacity): a function that calls f, but remembers the
+// results by the arguments (which have to be ints, chars, strings or bools,
+// anything else just calls f).  Once it holds `capacity` results the least
+// recently used one is dropped.  A recursive function bound to the memoized
+// version, like (let fib (memo (function n ...))), also uses it for its own
+// calls, since those look `fib` up by name.
+#define MEMO_DEFAULT_CAPACITY 65536
+
+typedef struct MemoEntry {
+    struct MemoEntry *chain; // next in the bucket
+    struct MemoEntry *prev; // least recently used list, newest first
+    struct MemoEntry *next;
+    uint64_t hash;
+    Value result;
+    size_t argc;
+    Value args[];
+} MemoEntry;
+
+typedef struct {
+    Value fn;
+    MemoEntry **buckets;
+    size_t bucket_count; // power of two
+    MemoEntry lru; // sentinel
+    size_t count;
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} Memo;
+
+uint64_t hash_args(size_t argc, Value *argv) {
+    uint64_t h = argc;
+    for (size_t i = 0; i < argc; ++i) {
+        h = hash_mix(h * 0x9e3779b97f4a7c15ULL ^ hash_value(argv[i]));
+    }
+    return h;
+}
+
+MemoEntry **memo_find(Memo *memo, uint64_t hash, size_t argc, Value *argv) {
+    MemoEntry **e = &memo->buckets[hash & (memo->bucket_count - 1)];
+    for (; *e != NULL; e = &(*e)->chain) {
+        if ((*e)->hash != hash || (*e)->argc != argc) continue;
+        bool equal = true;
+        for (size_t i = 0; equal && i < argc; ++i) {
+            equal = keys_equal((*e)->args[i], argv[i]);
+        }
+        if (equal) break;
+    }
+    return e;
+}
+
+void lru_unlink(MemoEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
 }
 
-Value native_print(EvalContext *ctx, size_t argc, Value *argv) {
-    for (size_t i = 0; i < argc; ++i) {
-        if (i != 0) printf(" ");
-        printf("%s", value_to_string(argv[i]));
+void lru_push(Memo *memo, MemoEntry *e) {
+    e->prev = &memo->lru;
+    e->next = memo->lru.next;
+    e->next->prev = e;
+    memo->lru.next = e;
+}
+
+void memo_grow(Memo *memo) {
+    size_t count = memo->bucket_count * 2;
+    MemoEntry **buckets = calloc(count, sizeof(MemoEntry *));
+    assert(buckets != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < memo->bucket_count; ++i) {
+        for (MemoEntry *e = memo->buckets[i], *chain; e != NULL; e = chain) {
+            chain = e->chain;
+            e->chain = buckets[e->hash & (count - 1)];
+            buckets[e->hash & (count - 1)] = e;
+        }
     }
-    return (Value) { 0 };
+    free(memo->buckets);
+    memo->buckets = buckets;
+    memo->bucket_count = count;
 }
 
-Value native_println(EvalContext *ctx, size_t argc, Value *argv) {
-    Value ret = native_print(ctx, argc, argv);
-    printf("\n");
-    return ret;
+// Entries keep their strings in buffers of their own rather than in whatever
+// the caller's came from, so the keys they own can be freed with them.
+Value memo_copy(Value v) {
+    if (v.kind != VK_STRING) return v;
+    String s = v.value.string;
+    char *items = malloc(s.count + 1);
+    assert(items != NULL && "Buy more RAM lol");
+    memcpy(items, s.items, s.count);
+    items[s.count] = '\0';
+    v.value.string = (String) { .items = items, .count = s.count, .capacity = -1 };
+    return v;
 }
 
-Value native_parseint(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 1);
-    Value arg = argv[0];
-    if (arg.kind != VK_STRING) {
-        PANIC("parseint accepts one string as its argument, found %s.", vk_names[arg.kind]);
+void memo_insert(Memo *memo, uint64_t hash, size_t argc, Value *argv, Value result) {
+    if (memo->count == memo->capacity) {
+        MemoEntry *oldest = memo->lru.prev;
+        *memo_find(memo, oldest->hash, oldest->argc, oldest->args) = oldest->chain;
+        lru_unlink(oldest);
+        // the result may have been handed out, the keys never are
+        for (size_t i = 0; i < oldest->argc; ++i) {
+            if (oldest->args[i].kind == VK_STRING) free(oldest->args[i].value.string.items);
+        }
+        free(oldest);
+        memo->count--;
+        memo->evictions++;
     }
+    if (memo->count >= memo->bucket_count) memo_grow(memo);
+
+    MemoEntry *e = malloc(sizeof(MemoEntry) + argc * sizeof(Value));
+    assert(e != NULL && "Buy more RAM lol");
+    e->hash = hash;
+    e->result = memo_copy(result);
+    e->argc = argc;
+    for (size_t i = 0; i < argc; ++i) e->args[i] = memo_copy(argv[i]);
+    MemoEntry **bucket = &memo->buckets[hash & (memo->bucket_count - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    lru_push(memo, e);
+    memo->count++;
+}
 
-    int value = atoi(arg.value.string.items);
-    return (Value) {
-        .kind = VK_INT,
-        .value.integer = value,
-    };
+Value memo_call(void *data, EvalContext *ctx, size_t argc, Value *argv) {
+    Memo *memo = data;
+    for (size_t i = 0; i < argc; ++i) {
+        if (!is_hashable(argv[i].kind)) return apply_fn(ctx, "memo", memo->fn, argc, argv);
+    }
+
+    uint64_t hash = hash_args(argc, argv);
+    MemoEntry *e = *memo_find(memo, hash, argc, argv);
+    if (e != NULL) {
+        memo->hits++;
+        lru_unlink(e);
+        lru_push(memo, e);
+        return e->result;
+    }
+
+    memo->misses++;
+    Value result = apply_fn(ctx, "memo", memo->fn, argc, argv);
+    // a recursive call can't have stored these arguments without recursing forever
+    memo_insert(memo, hash, argc, argv, result);
+    return result;
 }
 
-Value native_readline(EvalContext *ctx, size_t argc, Value *_argv) {
-    assert(argc == 0);
-    char *line = NULL;
-    size_t n = 0;
-    ssize_t r = getline(&line, &n, stdin);
-    if (r < 0) PANIC("Unexpeced error while running readline: %m");
-    line[--r] = '\0'; // remove newline
+Value native_memo(EvalContext *ctx, size_t argc, Value *argv) {
+    Value fn = argv[0];
+    if (fn.kind != VK_FUNCTION && fn.kind != VK_NATIVE_FUNCTION) PANIC("Argument one of memo must be a function, found %s.", vk_names[fn.kind]);
+    int capacity = MEMO_DEFAULT_CAPACITY;
+    if (argc > 1) {
+        if (argv[1].kind != VK_INT || argv[1].value.integer < 1) PANIC("Capacity of memo must be a positive INT.");
+        capacity = argv[1].value.integer;
+    }
+
+    Memo *memo = calloc(1, sizeof(Memo));
+    assert(memo != NULL && "Buy more RAM lol");
+    memo->fn = fn;
+    memo->capacity = capacity;
+    memo->bucket_count = 16;
+    memo->buckets = calloc(memo->bucket_count, sizeof(MemoEntry *));
+    assert(memo->buckets != NULL && "Buy more RAM lol");
+    memo->lru.prev = memo->lru.next = &memo->lru;
+
     return (Value) {
-        .kind = VK_STRING,
-        .value.string = {
-            .items = line,
-            .count = r,
-        }
+        .kind = VK_NATIVE_FUNCTION,
+        .value.native = {
+            .name = "memo",
+            .min_args = -1,
+            .max_args = -1,
+            .bound = memo_call,
+            .data = memo,
+        },
     };
 }
 
-Value native_append(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc >= 2);
-    if (argv[0].kind != VK_ARRAY) PANIC("Argument one of append must be an array");
-    ValueArray va = argv[0].value.array;
-    va.capacity = va.count + argc - 1;
-    Value *new_items = malloc(sizeof(Value) * va.capacity);
-    va.items = va.count == 0 ? new_items : memcpy(new_items, va.items, sizeof(Value) * va.count);
-    memcpy(va.items + va.count, argv + 1, sizeof(Value) * (argc - 1));
-    va.count += argc - 1;
+// ints are only 32 bits, so counters stop at INT_MAX rather than wrap
+Value stat_value(size_t n) {
+    return (Value) { .kind = VK_INT, .value.integer = n > INT_MAX ? INT_MAX : (int) n };
+}
+
+Value stat_key(const char *name) {
     return (Value) {
-        .kind = VK_ARRAY,
-        .value.array = va
+        .kind = VK_STRING,
+        .value.string = { .items = (char *) name, .count = strlen(name), .capacity = -1 },
     };
 }
 
-Value native_length(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 1);
-    int n;
-    switch (argv[0].kind) {
-        case VK_STRING:
-            n = argv[0].value.string.count;
-            break;
-        case VK_ARRAY:
-            n = argv[0].value.array.count;
-            break;
-        case VK_UNIT:
-        case VK_INT:
-        case VK_CHAR:
-        case VK_BOOL:
-        case VK_FUNCTION:
-        case VK_NATIVE_FUNCTION:
-        case __VK_LENGTH:
-            PANIC("Cannot get length of type %s.", vk_names[argv[0].kind]);
-            break;
+// (try body handler) calls body, and if it raises an error, calls handler
+// with the message instead (or returns unit without one).
+Value native_try(EvalContext *ctx, size_t argc, Value *argv) {
+    assert(argc == 1 || argc == 2);
+    for (size_t i = 0; i < argc; ++i) {
+        if (argv[i].kind != VK_FUNCTION && argv[i].kind != VK_NATIVE_FUNCTION) {
+            PANIC("Argument %ld of try must be a function, got %s", i + 1, vk_names[argv[i].kind]);
+        }
     }
-    return (Value) {
-        .kind = VK_INT,
-        .value.integer = n
-    };
+    // sigsetjmp has to be called from the frame that stays around, and only
+    // as a whole condition
+    ErrorHandler handler;
+    error_push(&handler);
+    if (sigsetjmp(handler.jmp, 0) == 0) {
+        Value ret = apply_fn(ctx, "try", argv[0], 0, NULL);
+        error_pop(&handler);
+        return ret;
+    }
+    if (argc == 1) return (Value) { 0 };
+
+    Value message = { .kind = VK_STRING };
+    extend_string(&message.value.string, new_string(error_message));
+    return apply_fn(ctx, "catch", argv[1], 1, &message);
 }
 
-Value native_int(EvalContext *ctx, size_t argc, Value *argv) {
+// (error message) raises an error, which ends the program unless it's in a
+// try.  It's the script's error, so it points there rather than here.
+Value native_error(EvalContext *ctx, size_t argc, Value *argv) {
     assert(argc == 1);
-    Value v = argv[0];
-    if (!coerce(&v, VK_INT)) PANIC("Cannot cast type %s to INT.", vk_names[v.kind]);
-    return v;
+    String message = value_to_string(argv[0]);
+    if (!error_handler) {
+        if (call_line) fprintf(stderr, "[ERROR] %s:%u:%u: ", file_name, call_line, call_col);
+        else fprintf(stderr, "[ERROR] %s: ", file_name);
+    }
+    raise_error("%.*s", (int) message.count, message.items);
 }
 
-Value native_string(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 1);
+// (memo_stats f): a map with the hits, misses, evictions, size and capacity of
+// a function made by memo
+Value native_memo_stats(EvalContext *ctx, size_t argc, Value *argv) {
+    Value fn = argv[0];
+    if (fn.kind != VK_NATIVE_FUNCTION || fn.value.native.bound != memo_call) {
+        PANIC("Argument one of memo_stats must be a function made by memo.");
+    }
+    Memo *memo = fn.value.native.data;
+    Map *m = new_map(5);
+    map_put(m, stat_key("hits"), stat_value(memo->hits));
+    map_put(m, stat_key("misses"), stat_value(memo->misses));
+    map_put(m, stat_key("evictions"), stat_value(memo->evictions));
+    map_put(m, stat_key("size"), stat_value(memo->count));
+    map_put(m, stat_key("capacity"), stat_value(memo->capacity));
     return (Value) {
-        .kind = VK_STRING,
-        .value.string = new_string(value_to_string(argv[0]))
+        .kind = VK_MAP,
+        .value.map = m,
     };
 }
 
-Value native_char(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 1);
-    Value v = argv[0];
-    if (!coerce(&v, VK_CHAR)) PANIC("Cannot cast type %s to CHAR.", vk_names[v.kind]);
-    return v;
+// Snapshots: `--snapshot out.img` runs a script and then saves the variables
+// it declared at the top, with everything they hold, as an image like the
+// script cache's.  `--resume out.img` maps one back in as the scope every
+// script it runs is evaluated in.  Natives are saved by name and looked up
+// again, and memo functions start with an empty cache.  Maps free their
+// tables when they grow, so those are copied to the heap when resuming;
+// everything else is used where it was mapped.
+#define SNAPSHOT_MAGIC "LISPSNP1"
+
+typedef struct {
+    Value fn;
+    size_t capacity;
+} MemoImage;
+
+#define VALUE_FIELD(at, member) ((at) + offsetof(Value, value.member))
+
+void image_value(ImageWriter *w, size_t at, Value v) {
+    memcpy(w->items + at, &v, sizeof(v));
+    switch (v.kind) {
+        case VK_UNIT:
+        case VK_INT:
+        case VK_CHAR:
+        case VK_BOOL:
+            break;
+        case VK_STRING: {
+            String s = v.value.string;
+            // borrowed, so that nothing tries to grow it in place
+            ssize_t borrowed = -1;
+            memcpy(w->items + VALUE_FIELD(at, string.capacity), &borrowed, sizeof(borrowed));
+            image_pointer(w, VALUE_FIELD(at, string.items), image_bytes(w, s.items, s.count));
+        } break;
+        case VK_ARRAY: {
+            ValueArray array = v.value.array;
+            memcpy(w->items + VALUE_FIELD(at, array.capacity), &array.count, sizeof(size_t));
+            if (array.count == 0) {
+                memset(w->items + VALUE_FIELD(at, array.items), 0, sizeof(Value *));
+                break;
+            }
+            ImageSeen *seen = image_find_seen(w, array.items);
+            size_t items;
+            if (seen && seen->count >= array.count) {
+                items = seen->at;
+            } else {
+                items = image_alloc(w, array.count * sizeof(Value));
+                for (size_t i = 0; i < array.count; ++i) {
+                    image_value(w, items + i * sizeof(Value), array.items[i]);
+                }
+                image_add_seen(w, array.items, items, array.count);
+            }
+            image_pointer(w, VALUE_FIELD(at, array.items), items);
+        } break;
+        case VK_FUNCTION:
+            if (v.value.fn.compiled) PANIC("Cannot snapshot compiled functions.");
+            image_fn_def(w, VALUE_FIELD(at, fn), v.value.fn);
+            break;
+        case VK_NATIVE_FUNCTION: {
+            NativeFunctionValue native = v.value.native;
+            NativeFunctionValue saved = { .name = NULL, .min_args = native.min_args, .max_args = native.max_args };
+            memcpy(w->items + VALUE_FIELD(at, native), &saved, sizeof(saved));
+            image_symbol(w, VALUE_FIELD(at, native.name), intern(native.name));
+            if (native.bound == memo_call) {
+                Memo *memo = native.data;
+                size_t m = image_alloc(w, sizeof(MemoImage));
+                image_value(w, m + offsetof(MemoImage, fn), memo->fn);
+                memcpy(w->items + m + offsetof(MemoImage, capacity), &memo->capacity, sizeof(size_t));
+                image_pointer(w, VALUE_FIELD(at, native.data), m);
+            } else if (native.bound) {
+                PANIC("Cannot snapshot native function '%s'.", native.name);
+            }
+            da_append(&w->natives, at);
+        } break;
+        case VK_READER:
+            PANIC("Cannot snapshot a reader.");
+        case VK_MAP: {
+            Map *m = v.value.map;
+            ImageSeen *seen = image_find_seen(w, m);
+            if (seen) {
+                image_pointer(w, VALUE_FIELD(at, map), seen->at);
+                break;
+            }
+            // before the entries, which may hold the map itself
+            size_t map = image_alloc(w, sizeof(Map));
+            image_add_seen(w, m, map, 1);
+            memcpy(w->items + map, m, sizeof(Map));
+            size_t ctrl = image_bytes(w, m->ctrl, m->capacity + MAP_GROUP_SIZE);
+            size_t entries = image_alloc(w, m->capacity * sizeof(MapEntry));
+            for (size_t i = 0; i < m->capacity; ++i) {
+                if (m->ctrl[i] < 0) continue;
+                size_t entry = entries + i * sizeof(MapEntry);
+                image_value(w, entry + offsetof(MapEntry, key), m->entries[i].key);
+                image_value(w, entry + offsetof(MapEntry, value), m->entries[i].value);
+            }
+            image_pointer(w, map + offsetof(Map, ctrl), ctrl);
+            image_pointer(w, map + offsetof(Map, entries), entries);
+            image_pointer(w, VALUE_FIELD(at, map), map);
+            da_append(&w->maps, map);
+        } break;
+        case __VK_LENGTH:
+            PANIC("unreachable");
+    }
 }
 
-Value native_bool(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 1);
-    Value v = argv[0];
-    if (!coerce(&v, VK_BOOL)) PANIC("Cannot cast type %s to BOOL.", vk_names[v.kind]);
-    return v;
+void snapshot_save(EvalContext *ctx, const char *path) {
+    ImageWriter w = { 0 };
+    image_alloc(&w, sizeof(ImageHeader));
+    size_t vars = image_alloc(&w, ctx->vars.count * sizeof(VariableMapEntry));
+    for (size_t i = 0; i < ctx->vars.count; ++i) {
+        size_t entry = vars + i * sizeof(VariableMapEntry);
+        image_symbol(&w, entry + offsetof(VariableMapEntry, key), ctx->vars.items[i].key);
+        image_value(&w, entry + offsetof(VariableMapEntry, value), ctx->vars.items[i].value);
+    }
+    size_t natives = image_offsets(&w, w.natives);
+    size_t maps = image_offsets(&w, w.maps);
+    size_t native_count = w.natives.count;
+    size_t map_count = w.maps.count;
+    free(w.natives.items);
+    free(w.maps.items);
+    image_finish(&w, SNAPSHOT_MAGIC);
+
+    ImageHeader *h = (ImageHeader *) w.items;
+    h->vars = vars;
+    h->var_count = ctx->vars.count;
+    h->natives = natives;
+    h->native_count = native_count;
+    h->maps = maps;
+    h->map_count = map_count;
+    if (!image_write(&w, path)) PANIC("Could not write snapshot %s: %m", path);
 }
 
-Value native_map(EvalContext *ctx, size_t argc, Value *argv) {
-    assert(argc == 2);
-    Value varray = argv[0];
-    if (varray.kind != VK_ARRAY) PANIC("Argument one of append must be an array");
-    ValueArray array = varray.value.array;
-    Value mapper = argv[1];
-    if (mapper.kind != VK_FUNCTION && mapper.kind != VK_NATIVE_FUNCTION) PANIC("Mapper must be a function");
-    ValueArray out = { 0 };
-    out.items = malloc(sizeof(Value) * (out.capacity = array.count));
+// the scope saved in a snapshot, under `global_ctx`
+EvalContext snapshot_load(const char *path, EvalContext *global_ctx) {
+    ImageHeader *h = image_map(path, SNAPSHOT_MAGIC);
+    if (h == NULL) PANIC("%s is not a snapshot made by this build of lisp.", path);
+    if (!image_fits(h, h->natives, h->native_count, sizeof(size_t))
+        || !image_fits(h, h->maps, h->map_count, sizeof(size_t))
+        || !image_fits(h, h->vars, h->var_count, sizeof(VariableMapEntry))
+        || !image_relocate(h)) {
+        PANIC("%s is a broken snapshot.", path);
+    }
+    char *base = (char *) h;
+
+    size_t *natives = (size_t *) (base + h->natives);
+    for (size_t i = 0; i < h->native_count; ++i) {
+        if (!image_fits(h, natives[i], 1, sizeof(Value))) PANIC("%s is a broken snapshot.", path);
+        Value *v = (Value *) (base + natives[i]);
+        NativeFunctionValue native = v->value.native;
+        if (native.data) {
+            MemoImage *memo = native.data;
+            Value args[] = { memo->fn, { .kind = VK_INT, .value.integer = memo->capacity } };
+            *v = native_memo(global_ctx, 2, args);
+            continue;
+        }
+        Value *global = get_var(global_ctx, native.name);
+        if (global == NULL || global->kind != VK_NATIVE_FUNCTION) PANIC("Unknown native function '%s' in snapshot.", native.name);
+        *v = *global;
+    }
 
-    for (size_t i = 0; i < array.count; ++i) {
-        out.items[i] = apply_fn(ctx, "mapper", mapper, 1, &array.items[i]);
+    size_t *maps = (size_t *) (base + h->maps);
+    for (size_t i = 0; i < h->map_count; ++i) {
+        if (!image_fits(h, maps[i], 1, sizeof(Map))) PANIC("%s is a broken snapshot.", path);
+        Map *m = (Map *) (base + maps[i]);
+        size_t ctrl_at = (char *) m->ctrl - base, entries_at = (char *) m->entries - base;
+        if (ctrl_at > h->size || m->capacity + MAP_GROUP_SIZE > h->size - ctrl_at
+            || !image_fits(h, entries_at, m->capacity, sizeof(MapEntry))) {
+            PANIC("%s is a broken snapshot.", path);
+        }
+        int8_t *ctrl = malloc(m->capacity + MAP_GROUP_SIZE);
+        MapEntry *entries = malloc(m->capacity * sizeof(MapEntry));
+        assert(ctrl != NULL && entries != NULL && "Buy more RAM lol");
+        memcpy(ctrl, m->ctrl, m->capacity + MAP_GROUP_SIZE);
+        memcpy(entries, m->entries, m->capacity * sizeof(MapEntry));
+        m->ctrl = ctrl;
+        m->entries = entries;
     }
-    out.count = array.count;
 
-    return (Value) {
-        .kind = VK_ARRAY,
-        .value.array = out,
-    };
+    EvalContext ctx = create_ctx(global_ctx);
+    ctx.vars.count = ctx.vars.capacity = h->var_count;
+    ctx.vars.items = malloc(h->var_count * sizeof(VariableMapEntry) + 1);
+    assert(ctx.vars.items != NULL && "Buy more RAM lol");
+    memcpy(ctx.vars.items, base + h->vars, h->var_count * sizeof(VariableMapEntry));
+    for (size_t i = 0; i < ctx.vars.count; ++i) {
+        SYMBOL(ctx.vars.items[i].key)->version++;
+    }
+    return ctx;
 }
 
 #define ADD_FN(fn_name, native_fn, min_argc, max_argc) \
-    set_var(&ctx, #fn_name, (Value) {  \
+    set_var(&ctx, intern(#fn_name), (Value) {  \
         .kind = VK_NATIVE_FUNCTION,      \
         .value = {                       \
             .native = {                  \
@@ -1996,16 +7245,45 @@ Value native_map(EvalContext *ctx, size_t argc, Value *argv) {
         .immutable = true                \
     });                                  \
 
+// natives that go through apply_fn, which the optimizers need to know
+#define ADD_CALLBACK_FN(fn_name, native_fn, min_argc, max_argc) \
+    ADD_FN(fn_name, native_fn, min_argc, max_argc); \
+    SYMBOL(intern(#fn_name))->calls_back = true;
+
 EvalContext create_global_ctx() {
     EvalContext ctx = create_ctx(NULL);
     ADD_FN(print, native_print, -1, -1);
     ADD_FN(println, native_println, -1, -1);
     ADD_FN(parseint, native_parseint, 1, -1);
     ADD_FN(readline, native_readline, 0, 0);
+    ADD_FN(flush, native_flush, 0, 0);
+    ADD_FN(lines, native_lines, 0, 1);
+    ADD_FN(next, native_next, 1, 1);
+    ADD_FN(done, native_done, 1, 1);
+    ADD_FN(read_all, native_read_all, 0, 1);
 
     ADD_FN(append, native_append, 2, -1);
     ADD_FN(length, native_length, 1, 1);
-    ADD_FN(map, native_map, 2, 2);
+    ADD_CALLBACK_FN(map, native_map, 2, 2);
+    ADD_FN(memo, native_memo, 1, 2);
+    ADD_FN(memo_stats, native_memo_stats, 1, 1);
+    ADD_CALLBACK_FN(try, native_try, 1, 2);
+    ADD_FN(error, native_error, 1, 1);
+    ADD_CALLBACK_FN(sort, native_sort, 1, 2);
+
+    ADD_FN(dict, native_dict, 0, -1);
+    ADD_FN(get, native_get, 2, 3);
+    ADD_FN(put, native_put, 3, 3);
+    ADD_FN(has, native_has, 2, 2);
+    ADD_FN(keys, native_keys, 1, 1);
+    ADD_FN(remove, native_remove, 2, 2);
+
+    ADD_FN(substr, native_substr, 2, 3);
+    ADD_FN(find, native_find, 2, 3);
+    ADD_FN(starts_with, native_starts_with, 2, 2);
+    ADD_FN(split, native_split, 2, 2);
+    ADD_FN(join, native_join, 2, 2);
+    ADD_FN(replace, native_replace, 3, 3);
 
     ADD_FN(int, native_int, 1, 1);
     ADD_FN(char, native_char, 1, 1);
@@ -2014,17 +7292,19 @@ EvalContext create_global_ctx() {
     return ctx;
 }
 
-int main(int argc, char **argv)
-{
-    FILE *file;
-    if (argc == 1) {
-        file = stdin;
-        file_name = "stdin";
-    } else {
-        file_name = argv[1];
-        file = fopen(argv[1], "rb");
-        if (!file) PANIC("Could not open file for reading %s: %m", argv[1]);
+#ifndef LISP_NO_MAIN
+// what the optimizer did depends on the names the snapshot declares, so
+// cached scripts are told apart by them too
+uint64_t script_hash(uint64_t source_hash) {
+    for (size_t i = 0; resumed_ctx && i < resumed_ctx->vars.count; ++i) {
+        const char *name = resumed_ctx->vars.items[i].key;
+        source_hash = hash_mix(source_hash ^ hash_bytes(name, strlen(name)));
     }
+    return source_hash;
+}
+
+// Parses a whole script and runs the optimizer over it.
+AST compile_script(FILE *file) {
     // Token tok;
     // while ((tok = next_token(file)).kind != TK_EOF) {
     //     printf("%s\n", token_string(tok));
@@ -2034,9 +7314,470 @@ int main(int argc, char **argv)
     if (tok.kind != TK_EOF) {
         ERROR("Expected EOF, found %s", token_string(tok));
     }
-    fclose(file);
-    print_ast(&ast, 0);
+    if (opt_enabled) {
+        optimize(&ast);
+        infer_types(&ast);
+        size_t inlined = inlined_count;
+        if (inline_enabled) inline_calls(&ast, &(InlinableList) { 0 }, false);
+        if (inlined_count != inlined) infer_types(&ast);
+        size_t hoisted = hoisted_count;
+        optimize_loops(&ast);
+        // again, for the hoisted variables
+        if (hoisted_count != hoisted) infer_types(&ast);
+    }
+    return ast;
+}
+
+// Server (--serve SOCKET): runs scripts sent over a Unix socket, without
+// paying for starting up, the global scope (or a --resume'd snapshot) or
+// compiling scripts it has seen before.  A pool of worker processes accepts
+// the connections, and every script runs in a process forked from its
+// worker, so nothing a script does (errors, crashes, its variables) outlives
+// it.  Workers keep the scripts they've compiled, and ones compiled in a
+// request's process are picked up from the script cache.
+//
+// A request is a line `path <n> <stdin-n>` or `source <n> <stdin-n>`,
+// followed by the n bytes of the script's path (as the server sees it) or its
+// source, and the stdin-n bytes the script gets as stdin.  The response is
+// made of `out <n>` and `err <n>` lines, each followed by n bytes the script
+// wrote to stdout or stderr, as it writes them, and ends with `exit <status>`.
+#define SERVE_MAX_REQUEST (256 << 20)
+#define SERVE_SCRIPTS 64 // compiled scripts a worker keeps
+
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    AST *ast;
+} ServeScript;
+
+static ServeScript serve_scripts[SERVE_SCRIPTS];
+static size_t serve_script_next;
+static int serve_listener = -1;
+static const char *serve_path;
+
+bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += w;
+        n -= w;
+    }
+    return true;
+}
+
+bool serve_frame(int conn, const char *tag, const char *data, size_t n) {
+    char header[64];
+    int len = snprintf(header, sizeof(header), "%s %ld\n", tag, n);
+    return write_all(conn, header, len) && write_all(conn, data, n);
+}
+
+AST *serve_find(uint64_t hash, size_t size) {
+    for (size_t i = 0; i < SERVE_SCRIPTS; ++i) {
+        ServeScript s = serve_scripts[i];
+        if (s.ast && s.hash == hash && s.size == size) return s.ast;
+    }
+    return NULL;
+}
+
+// looks for the script in the cache a request's process saved it to
+AST *serve_load(uint64_t hash, size_t size) {
+    char *path = image_path(hash);
+    AST *ast = path ? image_load(path, hash, size) : NULL;
+    free(path);
+    if (ast) {
+        serve_scripts[serve_script_next] = (ServeScript) { hash, size, ast };
+        serve_script_next = (serve_script_next + 1) % SERVE_SCRIPTS;
+    }
+    return ast;
+}
+
+// forwards what the script writes until it's done, returns its exit status
+int serve_output(int conn, pid_t pid, int out, int err) {
+    struct pollfd fds[] = { { .fd = out, .events = POLLIN }, { .fd = err, .events = POLLIN } };
+    const char *tags[] = { "out", "err" };
+    size_t open = 2;
+    char buf[64 * 1024];
+    while (open > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0 && serve_frame(conn, tags[i], buf, n)) continue;
+            if (n < 0 && errno == EINTR) continue;
+            // the client went away, nobody is reading what the script writes
+            if (n > 0) kill(pid, SIGKILL);
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            open--;
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// reads `n` bytes of the request into `fd`, or into `buf` when fd is -1
+bool serve_read(FILE *conn, int fd, char *buf, size_t n) {
+    char chunk[64 * 1024];
+    while (n > 0) {
+        size_t want = n < sizeof(chunk) ? n : sizeof(chunk);
+        size_t got = fread(fd < 0 ? buf : chunk, 1, want, conn);
+        if (got == 0) return false;
+        if (fd >= 0 && !write_all(fd, chunk, got)) return false;
+        if (fd < 0) buf += got;
+        n -= got;
+    }
+    return true;
+}
+
+void serve_request(int conn, EvalContext *global_ctx, bool cache) {
+    FILE *in = fdopen(dup(conn), "r");
+    if (in == NULL) return;
+    char header[256], mode[16];
+    size_t n, stdin_n;
+    if (!fgets(header, sizeof(header), in) || sscanf(header, "%15s %ld %ld", mode, &n, &stdin_n) != 3
+        || (strcmp(mode, "path") && strcmp(mode, "source")) || n > SERVE_MAX_REQUEST || stdin_n > SERVE_MAX_REQUEST) {
+        const char *message = "[SERVE] Malformed request\n";
+        serve_frame(conn, "err", message, strlen(message));
+        dprintf(conn, "exit 1\n");
+        fclose(in);
+        return;
+    }
+    bool is_path = !strcmp(mode, "path");
+    char *text = malloc(n + 1);
+    assert(text != NULL && "Buy more RAM lol");
+    int input = memfd_create("stdin", MFD_CLOEXEC);
+    if (input < 0 || !serve_read(in, -1, text, n) || !serve_read(in, input, NULL, stdin_n)) {
+        fclose(in);
+        free(text);
+        if (input >= 0) close(input);
+        return;
+    }
+    fclose(in);
+    text[n] = 0;
+    lseek(input, 0, SEEK_SET);
+
+    uint64_t hash;
+    size_t size = n;
+    bool hashed = is_path ? hash_source(text, &hash, &size) : (hash = hash_bytes(text, n), true);
+    AST *ast = NULL;
+    if (hashed) {
+        hash = script_hash(hash);
+        ast = serve_find(hash, size);
+        if (ast == NULL && cache) ast = serve_load(hash, size);
+    }
+
+    int out[2], err[2];
+    if (pipe(out) != 0 || pipe(err) != 0) PANIC("Could not create pipes: %m");
+    pid_t pid = fork();
+    if (pid < 0) PANIC("Could not fork: %m");
+    if (pid == 0) {
+        dup2(input, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(err[0]);
+        close(conn);
+        close(serve_listener);
+        signal(SIGPIPE, SIG_DFL);
+
+        file_name = is_path ? text : "request";
+        AST compiled;
+        if (ast == NULL) {
+            FILE *file = is_path ? fopen(text, "rb") : fmemopen(text, n, "rb");
+            if (!file) PANIC("Could not open file for reading %s: %m", text);
+            compiled = compile_script(file);
+            fclose(file);
+            char *cache_path = hashed && cache ? image_path(hash) : NULL;
+            if (cache_path) image_save(&compiled, cache_path, hash, size);
+            ast = &compiled;
+        }
+        out_init(false);
+        eval(*ast, resumed_ctx ? resumed_ctx : global_ctx);
+        exit(0);
+    }
+    close(input);
+    close(out[1]);
+    close(err[1]);
+    int status = serve_output(conn, pid, out[0], err[0]);
+    dprintf(conn, "exit %d\n", status);
+    // the request's process compiled it into the cache
+    if (hashed && ast == NULL && cache && status == 0) serve_load(hash, size);
+    free(text);
+}
+
+void serve_worker(EvalContext *global_ctx, bool cache) {
+#ifdef __linux__
+    // go away with the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    // a client hanging up mustn't kill the worker
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        int conn = accept(serve_listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            PANIC("Could not accept a connection: %m");
+        }
+        serve_request(conn, global_ctx, cache);
+        close(conn);
+    }
+}
+
+void serve_stop(int sig) {
+    unlink(serve_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+pid_t serve_spawn(EvalContext *global_ctx, bool cache) {
+    pid_t pid = fork();
+    if (pid < 0) PANIC("Could not fork a worker: %m");
+    if (pid == 0) {
+        serve_worker(global_ctx, cache);
+        exit(1);
+    }
+    return pid;
+}
+
+void serve(const char *path, size_t workers, EvalContext *global_ctx, bool cache) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) PANIC("Socket path is too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    // only replace what a previous server left behind
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) PANIC("%s exists and isn't a socket.", path);
+        unlink(path);
+    }
+    serve_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_listener < 0) PANIC("Could not create a socket: %m");
+    if (bind(serve_listener, (struct sockaddr *) &addr, sizeof(addr)) != 0) PANIC("Could not bind to %s: %m", path);
+    if (listen(serve_listener, SOMAXCONN) != 0) PANIC("Could not listen on %s: %m", path);
+    serve_path = path;
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+
+    pid_t pids[workers];
+    for (size_t i = 0; i < workers; ++i) pids[i] = serve_spawn(global_ctx, cache);
+    fprintf(stderr, "[SERVE] Listening on %s with %ld workers\n", path, workers);
+
+    for (;;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            PANIC("Could not wait for the workers: %m");
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            if (pids[i] != pid) continue;
+            fprintf(stderr, "[SERVE] Worker %d exited (status %d), starting another one\n", pid, status);
+            pids[i] = serve_spawn(global_ctx, cache);
+        }
+    }
+}
+
+char *read_fd(int fd, size_t *n) {
+    size_t capacity = 64 * 1024;
+    char *data = malloc(capacity);
+    assert(data != NULL && "Buy more RAM lol");
+    *n = 0;
+    ssize_t got;
+    while ((got = read(fd, data + *n, capacity - *n)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            PANIC("Could not read: %m");
+        }
+        *n += got;
+        if (*n == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+            assert(data != NULL && "Buy more RAM lol");
+        }
+    }
+    return data;
+}
+
+// Client of --serve (--connect SOCKET): sends the script (the path, which
+// the server has to be able to open, or the source read from stdin) along
+// with stdin, and writes what it gets back.
+int serve_connect(const char *socket_path, const char *script) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) PANIC("Socket path is too long: %s", socket_path);
+    strcpy(addr.sun_path, socket_path);
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0 || connect(conn, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        PANIC("Could not connect to %s: %m", socket_path);
+    }
+
+    size_t text_n, stdin_n = 0;
+    char *text, *input = NULL;
+    if (script) {
+        text = realpath(script, NULL);
+        if (text == NULL) PANIC("Could not find %s: %m", script);
+        text_n = strlen(text);
+        if (!isatty(STDIN_FILENO)) input = read_fd(STDIN_FILENO, &stdin_n);
+    } else {
+        text = read_fd(STDIN_FILENO, &text_n);
+    }
+    dprintf(conn, "%s %ld %ld\n", script ? "path" : "source", text_n, stdin_n);
+    if (!write_all(conn, text, text_n) || !write_all(conn, input, stdin_n)) {
+        PANIC("Could not send the request: %m");
+    }
+
+    FILE *in = fdopen(conn, "r");
+    char header[64], buf[64 * 1024];
+    while (fgets(header, sizeof(header), in)) {
+        size_t n;
+        int status;
+        if (sscanf(header, "exit %d", &status) == 1) return status;
+        if (sscanf(header, "out %ld", &n) != 1 && sscanf(header, "err %ld", &n) != 1) break;
+        int fd = header[0] == 'o' ? STDOUT_FILENO : STDERR_FILENO;
+        while (n > 0) {
+            size_t got = fread(buf, 1, n < sizeof(buf) ? n : sizeof(buf), in);
+            if (got == 0) PANIC("The server hung up.");
+            write_all(fd, buf, got);
+            n -= got;
+        }
+    }
+    PANIC("The server hung up.");
+}
+
+int main(int argc, char **argv)
+{
+    bool line_buffered = false;
+    bool dump_ast = false;
+    bool emit = false;
+    bool cache = !getenv("LISP_NO_CACHE");
+    const char *snapshot = NULL;
+    const char *resume = NULL;
+    const char *profile = NULL;
+    const char *trace = NULL;
+    const char *perf = NULL;
+    const char *heap_profile = NULL;
+    const char *serve_socket = NULL;
+    const char *connect_socket = NULL;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = NULL;
+    if (getenv("LISP_NO_JIT")) jit_enabled = false;
+    if (getenv("LISP_JIT_LOG")) jit_log = true;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--line-buffered")) {
+            line_buffered = true;
+        } else if (!strcmp(argv[i], "--no-jit")) {
+            jit_enabled = false;
+        } else if (!strcmp(argv[i], "--no-opt")) {
+            opt_enabled = false;
+        } else if (!strcmp(argv[i], "--dump-ast")) {
+            dump_ast = true;
+        } else if (!strcmp(argv[i], "--emit-c")) {
+            emit = true;
+        } else if (!strcmp(argv[i], "--no-cache")) {
+            cache = false;
+        } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (!strcmp(argv[i], "--resume") && i + 1 < argc) {
+            resume = argv[++i];
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (!strcmp(argv[i], "--heap-profile") && i + 1 < argc) {
+            heap_profile = argv[++i];
+        } else if (!strcmp(argv[i], "--perf") && i + 1 < argc) {
+            perf = argv[++i];
+        } else if (!strcmp(argv[i], "--stats")) {
+            atexit(stats_report);
+        } else if (!strcmp(argv[i], "--trace-calls") && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            serve_socket = argv[++i];
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = atol(argv[++i]);
+            if (workers < 1) PANIC("--workers needs a positive number.");
+        } else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+            connect_socket = argv[++i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            PANIC("Unexpected argument '%s'", argv[i]);
+        }
+    }
 
+    if (connect_socket) return serve_connect(connect_socket, path);
+    if (snapshot && resume) PANIC("--snapshot and --resume can't be used together.");
+    if (serve_socket && path) PANIC("--serve takes its scripts from the socket.");
+    if (trace) {
+        inline_enabled = false;
+        // cached scripts may have inlined functions
+        cache = false;
+    }
     EvalContext global_ctx = create_global_ctx();
-    eval(ast, &global_ctx);
+    EvalContext resumed;
+    if (resume) {
+        resumed = snapshot_load(resume, &global_ctx);
+        resumed_ctx = &resumed;
+    }
+    if (serve_socket) {
+        if (workers < 1) workers = 1;
+        serve(serve_socket, workers, &global_ctx, cache);
+    }
+
+    AST ast;
+    AST *cached = NULL;
+    char *cache_path = NULL;
+    uint64_t source_hash;
+    size_t source_size;
+    if (path != NULL && cache && hash_source(path, &source_hash, &source_size)) {
+        source_hash = script_hash(source_hash);
+        cache_path = image_path(source_hash);
+        if (cache_path) cached = image_load(cache_path, source_hash, source_size);
+    }
+
+    if (cached) {
+        file_name = path;
+        ast = *cached;
+    } else {
+        FILE *file;
+        if (path == NULL) {
+            file = stdin;
+            file_name = "stdin";
+        } else {
+            file_name = path;
+            file = fopen(path, "rb");
+            if (!file) PANIC("Could not open file for reading %s: %m", path);
+        }
+        ast = compile_script(file);
+        fclose(file);
+        if (cache_path) image_save(&ast, cache_path, source_hash, source_size);
+    }
+    if (dump_ast) print_ast(&ast, 0);
+    if (emit) {
+        emit_c(&ast, file_name, stdout);
+        return 0;
+    }
+    out_init(line_buffered);
+    if (profile) profile_start(profile);
+    if (trace) trace_start(&ast, trace);
+    if (perf) perf_start(perf);
+    if (heap_profile) heap_start(heap_profile);
+
+    if (snapshot) {
+        // the script's scope is the one saved
+        EvalContext ctx = create_ctx(&global_ctx);
+        eval_in_ctx(ast, &ctx);
+        snapshot_save(&ctx, snapshot);
+    } else {
+        eval(ast, resumed_ctx ? resumed_ctx : &global_ctx);
+    }
 }
+#endif // LISP_NO_MAIN
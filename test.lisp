@@ -3,4 +3,37 @@
     (println
         (map a (function x (* x 2)))
     )
+
+    (let n 10)
+    (for (let i 0) (< i n) (= i (+ i 1))
+        (eval
+            (try (function (= n 3)))
+            (print i " ")
+        )
+    )
+    (println)
+
+    (let x 100)
+    (let peek (function (println x)))
+    (let show (function x (try peek)))
+    (for (let i 0) (< i 2) (= i (+ i 1))
+        (show 5)
+    )
+
+    (let b 5)
+    (let g (function (println (+ b 1))))
+    (g)
+    (= b println)
+    (println (try g (function m (+ "" m))))
+
+    (let c 5)
+    (println (try
+        (function (for (let i 0) (< i 3) (= i (+ i 1))
+            (eval
+                (println (+ c 1))
+                (= c length)
+            )
+        ))
+        (function m (+ "" m))
+    ))
 )